@@ -30,6 +30,7 @@
 #include <mm/algo/slab.h>
 #include <mm/pmm.h>
 #include <global.h>
+#include <lib/util.h>
 
 static struct ARC_SlabMeta meta = { 0 };
 
@@ -38,7 +39,14 @@ void *ialloc(size_t size) {
 }
 
 void *icalloc(size_t size, size_t count) {
-	return slab_alloc(&meta, size * count);
+	size_t final = size * count;
+
+	if (count != 0 && final / count != size) {
+		ARC_DEBUG(ERR, "Overflow in icalloc (%lu * %lu)\n", size, count);
+		return NULL;
+	}
+
+	return slab_alloc_flags(&meta, final, ARC_SLAB_ZERO);
 }
 
 void *ifree(void *address) {
@@ -46,23 +54,45 @@ void *ifree(void *address) {
 }
 
 void *irealloc(void *address, size_t size) {
-	(void)address;
-	(void)size;
+	if (address == NULL) {
+		return ialloc(size);
+	}
+
+	if (size == 0) {
+		ifree(address);
+		return NULL;
+	}
+
+	size_t old = slab_size(&meta, address);
+
+	if (old == 0) {
+		ARC_DEBUG(ERR, "Failed to find %p\n", address);
+		return NULL;
+	}
 
-	ARC_DEBUG(ERR, "Unimplemented Arc_Realloc\n");
+	if (size <= old) {
+		// Still fits the object's class
+		return address;
+	}
 
-	return NULL;
+	void *new = ialloc(size);
+
+	if (new == NULL) {
+		return NULL;
+	}
+
+	memcpy(new, address, old);
+	ifree(address);
+
+	return new;
 }
 
 int iallocator_expand(size_t pages) {
-	int cumulative_err = (slab_expand(&meta, 0, pages) == 0);
-	cumulative_err += (slab_expand(&meta, 1, pages) == 0);
-	cumulative_err += (slab_expand(&meta, 2, pages) == 0);
-	cumulative_err += (slab_expand(&meta, 3, pages) == 0);
-	cumulative_err += (slab_expand(&meta, 4, pages) == 0);
-	cumulative_err += (slab_expand(&meta, 5, pages) == 0);
-	cumulative_err += (slab_expand(&meta, 6, pages) == 0);
-	cumulative_err += (slab_expand(&meta, 7, pages) == 0);
+	int cumulative_err = 0;
+
+	for (int i = 0; i < meta.classes; i++) {
+		cumulative_err += (slab_expand(&meta, i, pages) == 0);
+	}
 
 	return cumulative_err;
 }
@@ -71,5 +101,11 @@ int init_iallocator(size_t pages) {
 	size_t range_length = (pages << 12) * 8;
 	void *range = (void *)pmm_contig_alloc(pages * 8);
 
-	return init_slab(&meta, range, range_length, 0) != range + range_length;
+	// Bit 1: the data structures of the other algorithms are allocated and
+	//        freed from every CPU, keep the lists lock-free
+	if (init_slab(&meta, range, range_length, NULL, 8, 1 << 1) != range + range_length) {
+		return -1;
+	}
+
+	return slab_set_growth(&meta, ARC_SLAB_GROW_FIXED, pages, 0);
 }
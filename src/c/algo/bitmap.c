@@ -0,0 +1,524 @@
+/**
+ * @file bitmap.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Bitmap backed region allocator.
+*/
+#include <mm/algo/bitmap.h>
+#include <mm/algo/range.h>
+#include <lib/atomics.h>
+#include <lib/util.h>
+#include <global.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#define ADDRESS_IN_META(address, meta) ((void *)meta->base <= (void *)address && (void *)address <= (void *)meta->ceil)
+#define BITMAP_NONE UINT64_MAX
+#define BITMAP_WORDS(meta) (((meta)->objects + 63) >> 6)
+
+// Index of the first set (free) bit at or after bit
+// Return: BITMAP_NONE = no free object
+static uint64_t next_set(struct ARC_BitmapMeta *meta, uint64_t bit) {
+	uint64_t words = BITMAP_WORDS(meta);
+	uint64_t word = bit >> 6;
+
+	if (word >= words) {
+		return BITMAP_NONE;
+	}
+
+	uint64_t value = meta->bitmap[word] & (UINT64_MAX << (bit & 63));
+
+	while (value == 0) {
+		if (++word >= words) {
+			return BITMAP_NONE;
+		}
+
+		value = meta->bitmap[word];
+	}
+
+	return (word << 6) + __builtin_ctzl(value);
+}
+
+// Index of the first clear (allocated) bit at or after bit, the search stops at limit
+// Return: index of the clear bit, or limit if there is none before it
+static uint64_t next_clear(struct ARC_BitmapMeta *meta, uint64_t bit, uint64_t limit) {
+	uint64_t words = BITMAP_WORDS(meta);
+	uint64_t word = bit >> 6;
+
+	while (word < words && (word << 6) < limit) {
+		uint64_t value = ~meta->bitmap[word];
+
+		if (word == bit >> 6) {
+			value &= UINT64_MAX << (bit & 63);
+		}
+
+		if (value != 0) {
+			return min((word << 6) + __builtin_ctzl(value), limit);
+		}
+
+		word++;
+	}
+
+	return min(meta->objects, limit);
+}
+
+static void set_range(struct ARC_BitmapMeta *meta, uint64_t bit, uint64_t count, int free) {
+	while (count > 0) {
+		uint64_t word = bit >> 6;
+		uint64_t offset = bit & 63;
+		uint64_t span = min(64 - offset, count);
+		uint64_t mask = (span == 64 ? UINT64_MAX : ((((uint64_t)1) << span) - 1)) << offset;
+
+		if (free) {
+			meta->bitmap[word] |= mask;
+		} else {
+			meta->bitmap[word] &= ~mask;
+		}
+
+		bit += span;
+		count -= span;
+	}
+}
+
+// Find the first run of count free objects
+// Return: index of the first object of the run, BITMAP_NONE = no such run
+static uint64_t find_run(struct ARC_BitmapMeta *meta, uint64_t count, uint64_t align) {
+	uint64_t bit = 0;
+
+	while (bit + count <= meta->objects) {
+		uint64_t start = next_set(meta, bit);
+
+		if (start != BITMAP_NONE && align > meta->object_size) {
+			// Skip to the first object at an aligned address
+			uint64_t address = (uint64_t)meta->base + start * meta->object_size;
+			start = (ALIGN(address, align) - (uint64_t)meta->base) / meta->object_size;
+		}
+
+		if (start == BITMAP_NONE || start + count > meta->objects) {
+			break;
+		}
+
+		uint64_t end = next_clear(meta, start, start + count);
+
+		if (end - start >= count) {
+			return start;
+		}
+
+		bit = max(end, start + 1);
+	}
+
+	return BITMAP_NONE;
+}
+
+void *bitmap_alloc(struct ARC_BitmapMeta *meta) {
+	if (meta == NULL) {
+		ARC_DEBUG(ERR, "Given meta is NULL\n");
+		return NULL;
+	}
+
+	mutex_lock(&meta->mutex);
+
+	while (meta != NULL && meta->free_objects < 1) {
+		if (meta->next != NULL) {
+			mutex_lock(&meta->next->mutex);
+		}
+
+		mutex_unlock(&meta->mutex);
+		meta = meta->next;
+	}
+
+	if (meta == NULL) {
+		ARC_DEBUG(ERR, "Found meta is NULL\n");
+		return NULL;
+	}
+
+	uint64_t bit = next_set(meta, meta->hint << 6);
+
+	if (bit == BITMAP_NONE) {
+		// Hint was stale, look from the start
+		bit = next_set(meta, 0);
+	}
+
+	if (bit == BITMAP_NONE) {
+		ARC_DEBUG(ERR, "Meta %p claims %lu free objects, but has none\n", meta, meta->free_objects);
+		mutex_unlock(&meta->mutex);
+		return NULL;
+	}
+
+	meta->bitmap[bit >> 6] &= ~(((uint64_t)1) << (bit & 63));
+	meta->free_objects--;
+	meta->hint = bit >> 6;
+
+	mutex_unlock(&meta->mutex);
+
+	return meta->base + bit * meta->object_size;
+}
+
+uint64_t bitmap_alloc_n(struct ARC_BitmapMeta *meta, uint64_t count, void **objects) {
+	if (meta == NULL || objects == NULL) {
+		ARC_DEBUG(ERR, "Invalid parameters\n");
+		return 0;
+	}
+
+	uint64_t taken = 0;
+
+	while (meta != NULL && taken < count) {
+		mutex_lock(&meta->mutex);
+
+		uint64_t bit = meta->hint << 6;
+
+		while (taken < count && meta->free_objects > 0) {
+			bit = next_set(meta, bit);
+
+			if (bit == BITMAP_NONE) {
+				// Hint was stale, look from the start
+				bit = next_set(meta, 0);
+			}
+
+			if (bit == BITMAP_NONE) {
+				ARC_DEBUG(ERR, "Meta %p claims %lu free objects, but has none\n", meta, meta->free_objects);
+				break;
+			}
+
+			meta->bitmap[bit >> 6] &= ~(((uint64_t)1) << (bit & 63));
+			meta->free_objects--;
+			meta->hint = bit >> 6;
+
+			objects[taken++] = meta->base + bit * meta->object_size;
+		}
+
+		struct ARC_BitmapMeta *next = meta->next;
+		mutex_unlock(&meta->mutex);
+		meta = next;
+	}
+
+	return taken;
+}
+
+void *bitmap_contig_alloc(struct ARC_BitmapMeta *meta, uint64_t objects) {
+	return bitmap_contig_alloc_aligned(meta, objects, 0);
+}
+
+void *bitmap_contig_alloc_aligned(struct ARC_BitmapMeta *meta, uint64_t objects, uint64_t align) {
+	if (meta == NULL || objects == 0 || (align & (align - 1)) != 0) {
+		ARC_DEBUG(ERR, "Invalid parameters\n");
+		return NULL;
+	}
+
+	for (; meta != NULL; meta = meta->next) {
+		mutex_lock(&meta->mutex);
+
+		if (meta->free_objects < objects) {
+			mutex_unlock(&meta->mutex);
+			continue;
+		}
+
+		uint64_t bit = find_run(meta, objects, align);
+
+		if (bit != BITMAP_NONE) {
+			set_range(meta, bit, objects, 0);
+			meta->free_objects -= objects;
+
+			mutex_unlock(&meta->mutex);
+
+			return meta->base + bit * meta->object_size;
+		}
+
+		mutex_unlock(&meta->mutex);
+	}
+
+	ARC_DEBUG(ERR, "No run of %lu objects\n", objects);
+
+	return NULL;
+}
+
+// Lock and return the meta owning address, NULL if there is none
+static struct ARC_BitmapMeta *find_owner(struct ARC_BitmapMeta *meta, void *address) {
+	struct ARC_BitmapMeta *owner = range_index_find(meta->index, address);
+
+	if (owner != NULL) {
+		mutex_lock(&owner->mutex);
+		return owner;
+	}
+
+	// Not indexed, walk the chain
+	mutex_lock(&meta->mutex);
+
+	while (meta != NULL && !ADDRESS_IN_META(address, meta)) {
+		if (meta->next != NULL) {
+			mutex_lock(&meta->next->mutex);
+		}
+
+		mutex_unlock(&meta->mutex);
+		meta = meta->next;
+	}
+
+	return meta;
+}
+
+int bitmap_is_allocated(struct ARC_BitmapMeta *meta, void *address) {
+	if (meta == NULL) {
+		return 0;
+	}
+
+	struct ARC_BitmapMeta *owner = NULL;
+	int locked = 0;
+
+	if (meta->index != NULL) {
+		owner = range_index_find(meta->index, address);
+	}
+
+	if (owner == NULL) {
+		// Not indexed, or not in the chain at all
+		owner = find_owner(meta, address);
+		locked = 1;
+	}
+
+	if (owner == NULL) {
+		return 0;
+	}
+
+	uint64_t offset = (uint64_t)(address - owner->base);
+	uint64_t bit = offset / owner->object_size;
+	int allocated = 0;
+
+	if (offset % owner->object_size == 0 && bit < owner->objects) {
+		// Only the bit of the object is of interest, which does not change
+		// while the object is allocated, so the word need not be locked
+		uint64_t word = __atomic_load_n(&owner->bitmap[bit >> 6], __ATOMIC_RELAXED);
+		allocated = ((word >> (bit & 63)) & 1) == 0;
+	}
+
+	if (locked) {
+		mutex_unlock(&owner->mutex);
+	}
+
+	return allocated;
+}
+
+void *bitmap_free(struct ARC_BitmapMeta *meta, void *address) {
+	return bitmap_contig_free(meta, address, 1);
+}
+
+void *bitmap_contig_free(struct ARC_BitmapMeta *meta, void *address, uint64_t objects) {
+	if (meta == NULL || address == NULL || objects == 0) {
+		ARC_DEBUG(ERR, "Failed to free %p in %p\n", address, meta);
+		return NULL;
+	}
+
+	meta = find_owner(meta, address);
+
+	if (meta == NULL) {
+		ARC_DEBUG(ERR, "Could not find %p in given bitmap\n", address);
+		return NULL;
+	}
+
+	uint64_t offset = (uint64_t)(address - meta->base);
+	uint64_t bit = offset / meta->object_size;
+
+	if (offset % meta->object_size != 0 || bit + objects > meta->objects) {
+		ARC_DEBUG(ERR, "%p (%lu objects) is not a valid section of %p\n", address, objects, meta);
+		mutex_unlock(&meta->mutex);
+		return NULL;
+	}
+
+	if (next_set(meta, bit) < bit + objects) {
+		ARC_DEBUG(ERR, "Section %p (%lu objects) is already partially free\n", address, objects);
+		mutex_unlock(&meta->mutex);
+		return NULL;
+	}
+
+	set_range(meta, bit, objects, 1);
+	meta->free_objects += objects;
+	meta->hint = min(meta->hint, bit >> 6);
+
+	mutex_unlock(&meta->mutex);
+
+	return address;
+}
+
+uint64_t bitmap_free_n(struct ARC_BitmapMeta *meta, uint64_t count, void **objects) {
+	if (meta == NULL || objects == NULL) {
+		ARC_DEBUG(ERR, "Invalid parameters\n");
+		return 0;
+	}
+
+	struct ARC_BitmapMeta *owner = NULL;
+	uint64_t freed = 0;
+
+	for (uint64_t i = 0; i < count; i++) {
+		void *address = objects[i];
+
+		// Keep the owner locked for as long as the objects belong to it
+		if (owner == NULL || !ADDRESS_IN_META(address, owner)) {
+			if (owner != NULL) {
+				mutex_unlock(&owner->mutex);
+			}
+
+			owner = find_owner(meta, address);
+
+			if (owner == NULL) {
+				ARC_DEBUG(ERR, "Could not find %p in given bitmap\n", address);
+				continue;
+			}
+		}
+
+		uint64_t offset = (uint64_t)(address - owner->base);
+		uint64_t bit = offset / owner->object_size;
+
+		if (offset % owner->object_size != 0 || ((owner->bitmap[bit >> 6] >> (bit & 63)) & 1) != 0) {
+			ARC_DEBUG(ERR, "%p is not an allocated object of %p\n", address, owner);
+			continue;
+		}
+
+		owner->bitmap[bit >> 6] |= ((uint64_t)1) << (bit & 63);
+		owner->free_objects++;
+		owner->hint = min(owner->hint, bit >> 6);
+		freed++;
+	}
+
+	if (owner != NULL) {
+		mutex_unlock(&owner->mutex);
+	}
+
+	return freed;
+}
+
+// Combine bitmap A and bitmap B into a single chain
+// Return: 0 = success
+// Return: -1 = object size mismatch
+// Return: -2 = either bitmap was NULL
+int link_bitmaps(struct ARC_BitmapMeta *A, struct ARC_BitmapMeta *B) {
+	if (A == NULL || B == NULL) {
+		return -2;
+	}
+
+	if (A->object_size != B->object_size) {
+		return -1;
+	}
+
+	mutex_lock(&A->mutex);
+
+	// Advance to the last bitmap
+	struct ARC_BitmapMeta *last = A;
+	while (last->next != NULL) {
+		mutex_lock(&last->next->mutex);
+		mutex_unlock(&last->mutex);
+		last = last->next;
+	}
+
+	last->next = B;
+	B->index = A->index;
+
+	mutex_unlock(&last->mutex);
+
+	if (B->index != NULL && range_index_insert(B->index, B->base, B->ceil, B) != 0) {
+		ARC_DEBUG(INFO, "Could not index %p, frees into it will walk the chain\n", B);
+	}
+
+	return 0;
+}
+
+int bitmap_attach_index(struct ARC_BitmapMeta *meta, struct ARC_RangeIndex *index) {
+	if (meta == NULL || index == NULL) {
+		return -1;
+	}
+
+	int err = 0;
+
+	for (; meta != NULL; meta = meta->next) {
+		meta->index = index;
+
+		if (range_index_insert(index, meta->base, meta->ceil, meta) != 0) {
+			err = -2;
+		}
+	}
+
+	return err;
+}
+
+size_t bitmap_bookkeeping_size(uint64_t _base, uint64_t _ceil, uint64_t _object_size) {
+	if (_base > _ceil || _object_size == 0) {
+		return 0;
+	}
+
+	uint64_t objects = (_ceil - _base) / _object_size;
+
+	return ((objects + 63) >> 6) * sizeof(uint64_t);
+}
+
+int init_static_bitmap(struct ARC_BitmapMeta *meta, uint64_t *bitmap, uint64_t _base, uint64_t _ceil, uint64_t _object_size) {
+	if (meta == NULL || bitmap == NULL || _base >= _ceil || _object_size == 0) {
+		return -1;
+	}
+
+	uint64_t objects = (_ceil - _base) / _object_size;
+
+	if (objects == 0) {
+		return -1;
+	}
+
+	memset(meta, 0, sizeof(*meta));
+	memset(bitmap, 0, bitmap_bookkeeping_size(_base, _ceil, _object_size));
+
+	init_static_mutex(&meta->mutex);
+
+	meta->base = (void *)_base;
+	meta->ceil = (void *)(_base + (objects - 1) * _object_size);
+	meta->bitmap = bitmap;
+	meta->object_size = _object_size;
+	meta->objects = objects;
+
+	return 0;
+}
+
+struct ARC_BitmapMeta *init_bitmap(uint64_t _base, uint64_t _ceil, uint64_t _object_size) {
+	if (_base > _ceil || _object_size == 0) {
+		return NULL;
+	}
+
+	// Reserve enough objects at the base for the meta and a bitmap of the whole region
+	uint64_t reserved = ALIGN(sizeof(struct ARC_BitmapMeta), 8) + bitmap_bookkeeping_size(_base, _ceil, _object_size);
+	uint64_t objects = (reserved + _object_size - 1) / _object_size;
+
+	if (_ceil - _base < (objects + 1) * _object_size) {
+		// There is not enough space for one object
+		return NULL;
+	}
+
+	struct ARC_BitmapMeta *meta = (struct ARC_BitmapMeta *)_base;
+	uint64_t *bitmap = (uint64_t *)(_base + ALIGN(sizeof(struct ARC_BitmapMeta), 8));
+	uint64_t base = _base + objects * _object_size;
+
+	if (init_static_bitmap(meta, bitmap, base, _ceil, _object_size) != 0) {
+		return NULL;
+	}
+
+	set_range(meta, 0, meta->objects, 1);
+	meta->free_objects = meta->objects;
+
+	ARC_DEBUG(INFO, "Creating bitmap from 0x%"PRIx64" (%p) to 0x%"PRIx64" (%p) with objects of %lu bytes\n", base, meta->base, _ceil, meta->ceil, _object_size);
+
+	return meta;
+}
@@ -26,62 +26,113 @@
 */
 
 #include <mm/algo/buddy.h>
-#include <mm/algo/allocator.h>
 #include <mm/pmm.h>
 #include <global.h>
 #include <stdbool.h>
 #include <lib/util.h>
 
-struct buddy_node {
-	struct buddy_node *next;
-	void *base;
-	size_t size;
-	uint32_t attributes; // Bit | Description
-			     // 0   | 1: Allocated, 0: Free
+#define BUDDY_MAX_ORDERS 64
+#define BUDDY_NIL UINT32_MAX
+
+// Index of the block of the given order starting at the given unit within the
+// implicit binary tree (root is index 0)
+#define NODE_INDEX(tree, order, unit) ((((size_t)1) << ((tree)->max_order - (order))) - 1 + ((unit) >> (order)))
+#define BIT_GET(map, i) (((map)[(i) >> 6] >> ((i) & 63)) & 1)
+#define BIT_SET(map, i) ((map)[(i) >> 6] |= ((uint64_t)1 << ((i) & 63)))
+#define BIT_CLEAR(map, i) ((map)[(i) >> 6] &= ~((uint64_t)1 << ((i) & 63)))
+
+struct buddy_link {
+	uint32_t next;
+	uint32_t prev;
 };
 
-static int split(struct ARC_BuddyMeta *meta, struct buddy_node *node) {
-	if (node == NULL || (node->attributes & 1) == 1) {
-		return -1;
-	}
+struct buddy_tree {
+	/// Head of the free list of each order (unit index or BUDDY_NIL).
+	uint32_t free[BUDDY_MAX_ORDERS];
+	/// Free list links, indexed by the first unit of a free block.
+	struct buddy_link *links;
+	/// Bit per tree node, set if the block is split into two children.
+	uint64_t *split;
+	/// Bit per tree node, set if the block is allocated.
+	uint64_t *allocated;
+	/// Number of smallest_object sized units in the allocator.
+	size_t units;
+	/// Order of the root of the tree.
+	int max_order;
+};
 
-	if (node->size == meta->smallest_object) {
-		return -2;
+static void push(struct buddy_tree *tree, int order, uint32_t unit) {
+	uint32_t head = tree->free[order];
+
+	tree->links[unit].next = head;
+	tree->links[unit].prev = BUDDY_NIL;
+
+	if (head != BUDDY_NIL) {
+		tree->links[head].prev = unit;
 	}
 
-	size_t new_size = node->size >> 1;
+	tree->free[order] = unit;
+}
+
+static void unlink(struct buddy_tree *tree, int order, uint32_t unit) {
+	struct buddy_link *link = &tree->links[unit];
+
+	if (link->prev != BUDDY_NIL) {
+		tree->links[link->prev].next = link->next;
+	} else {
+		tree->free[order] = link->next;
+	}
 
-	struct buddy_node *buddy = ialloc(sizeof(*buddy));
+	if (link->next != BUDDY_NIL) {
+		tree->links[link->next].prev = link->prev;
+	}
+}
 
-	if (buddy == NULL) {
-		return -3;
+static bool is_free(struct buddy_tree *tree, int order, size_t unit) {
+	if (unit + ((size_t)1 << order) > tree->units) {
+		// Block (partially) lies outside of the allocator
+		return false;
 	}
 
-	memset(buddy, 0, sizeof(*buddy));
+	size_t node = NODE_INDEX(tree, order, unit);
+
+	return BIT_GET(tree->split, node) == 0 && BIT_GET(tree->allocated, node) == 0;
+}
 
-	buddy->size = new_size;
-	buddy->base = node->base + new_size;
-	buddy->next = node->next;
+// Split the free block of order order at unit into two, the upper half is placed
+// on the free list of order - 1, the lower half is left to the caller
+static int split(struct buddy_tree *tree, int order, uint32_t unit) {
+	if (order == 0) {
+		return -1;
+	}
 
-	node->next = buddy;
-	node->size = new_size;
+	BIT_SET(tree->split, NODE_INDEX(tree, order, unit));
+	push(tree, order - 1, unit + ((uint32_t)1 << (order - 1)));
 
 	return 0;
 }
 
-static int merge(struct buddy_node *base) {
-	if (base == NULL || (base->attributes & 1) == 1) {
+// Merge the free block of order *order at *unit with its buddy, on success
+// *order and *unit describe the merged block
+static int merge(struct buddy_tree *tree, int *order, uint32_t *unit) {
+	if (*order >= tree->max_order) {
 		return -1;
 	}
 
-	if (base->next == NULL || (base->next->attributes & 1) == 1 || base->size != base->next->size) {
+	uint32_t buddy = *unit ^ ((uint32_t)1 << *order);
+
+	if (!is_free(tree, *order, buddy)) {
 		return -2;
 	}
 
-	base->size <<= 1;
-	void *tmp = base->next;
-	base->next = base->next->next;
-	ifree(tmp);
+	unlink(tree, *order, buddy);
+	unlink(tree, *order, *unit);
+
+	*unit &= ~((uint32_t)1 << *order);
+	(*order)++;
+
+	BIT_CLEAR(tree->split, NODE_INDEX(tree, *order, *unit));
+	push(tree, *order, *unit);
 
 	return 0;
 }
@@ -97,93 +148,393 @@ void *buddy_alloc(struct ARC_BuddyMeta *meta, size_t size) {
 		return NULL;
 	}
 
-	struct buddy_node *current = meta->tree;
+	struct buddy_tree *tree = meta->tree;
 
 	// Align the size up
 	SIZE_T_NEXT_POW2(size);
 
-	while (current != NULL) {
-		if ((current->attributes & 1) == 1) {
-			// Already allocated
-			goto cycle_end;
-		}
+	int order = __builtin_ctzl(size / meta->smallest_object);
 
-		if (size > current->size) {
-			goto cycle_end;
-		}
+	if (order > tree->max_order) {
+		return NULL;
+	}
+
+	mutex_lock(&meta->mutex);
+
+	int current = order;
+	while (current <= tree->max_order && tree->free[current] == BUDDY_NIL) {
+		current++;
+	}
+
+	if (current > tree->max_order) {
+		mutex_unlock(&meta->mutex);
+		return NULL;
+	}
+
+	uint32_t unit = tree->free[current];
+	unlink(tree, current, unit);
+
+	for (; current > order; current--) {
+		split(tree, current, unit);
+	}
+
+	BIT_SET(tree->allocated, NODE_INDEX(tree, order, unit));
+
+	mutex_unlock(&meta->mutex);
 
-		if (current->size > size) {
-			while (current->size != size) {
-				if (split(meta, current) != 0) {
-					break;
+	return meta->base + unit * meta->smallest_object;
+}
+
+// Unit of the given address, or -1 if it cannot be the base of a block
+static int64_t unit_of(struct ARC_BuddyMeta *meta, void *address) {
+	if (meta == NULL || meta->tree == NULL) {
+		return -1;
+	}
+
+	if (address < meta->base || address >= meta->ceil) {
+		return -1;
+	}
+
+	size_t offset = (size_t)(address - meta->base);
+
+	if (offset % meta->smallest_object != 0) {
+		return -1;
+	}
+
+	return offset / meta->smallest_object;
+}
+
+// Order of the allocated block starting at unit, or -1 if there is none,
+// the meta must be locked
+static int allocated_order(struct buddy_tree *tree, uint32_t unit) {
+	// Descend from the root to the block containing the address
+	int order = tree->max_order;
+	while (order > 0 && BIT_GET(tree->split, NODE_INDEX(tree, order, unit)) == 1) {
+		order--;
+	}
+
+	if ((unit & (((size_t)1 << order) - 1)) != 0 || BIT_GET(tree->allocated, NODE_INDEX(tree, order, unit)) == 0) {
+		// Not the base of an allocated block
+		return -1;
+	}
+
+	return order;
+}
+
+// Order of the smallest block holding size bytes, or -1 if none can
+static int order_of(struct ARC_BuddyMeta *meta, size_t size) {
+	struct buddy_tree *tree = meta->tree;
+
+	if (size < meta->smallest_object) {
+		size = meta->smallest_object;
+	}
+
+	SIZE_T_NEXT_POW2(size);
+
+	int order = __builtin_ctzl(size / meta->smallest_object);
+
+	return order > tree->max_order ? -1 : order;
+}
+
+void *buddy_alloc_aligned(struct ARC_BuddyMeta *meta, size_t size, size_t align) {
+	if (meta == NULL || size == 0 || meta->tree == NULL || (align & (align - 1)) != 0) {
+		ARC_DEBUG(ERR, "Invalid parameters\n");
+		return NULL;
+	}
+
+	if (align == 0) {
+		align = 1;
+	}
+
+	struct buddy_tree *tree = meta->tree;
+	int order = order_of(meta, size);
+
+	if (order < 0) {
+		return NULL;
+	}
+
+	size_t block = meta->smallest_object << order;
+
+	if (align <= block && ((uintptr_t)meta->base & (align - 1)) == 0) {
+		// Every block of the order is aligned already
+		return buddy_alloc(meta, size);
+	}
+
+	mutex_lock(&meta->mutex);
+
+	// Find a free block containing an aligned block of the order
+	for (int current = order; current <= tree->max_order; current++) {
+		for (uint32_t unit = tree->free[current]; unit != BUDDY_NIL; unit = tree->links[unit].next) {
+			uintptr_t address = ALIGN((uintptr_t)meta->base + unit * meta->smallest_object, align);
+			size_t target = ALIGN((address - (uintptr_t)meta->base) / meta->smallest_object, (size_t)1 << order);
+
+			if ((((uintptr_t)meta->base + target * meta->smallest_object) & (align - 1)) != 0
+			    || target + ((size_t)1 << order) > unit + ((size_t)1 << current)) {
+				continue;
+			}
+
+			// Split down towards the target, freeing the halves
+			// not on the way
+			unlink(tree, current, unit);
+
+			for (; current > order; current--) {
+				uint32_t half = (uint32_t)1 << (current - 1);
+
+				BIT_SET(tree->split, NODE_INDEX(tree, current, unit));
+
+				if (target >= unit + half) {
+					push(tree, current - 1, unit);
+					unit += half;
+				} else {
+					push(tree, current - 1, unit + half);
 				}
 			}
+
+			BIT_SET(tree->allocated, NODE_INDEX(tree, order, unit));
+
+			mutex_unlock(&meta->mutex);
+
+			return meta->base + unit * meta->smallest_object;
 		}
+	}
 
-		if (current->size == size) {
-			break;
+	mutex_unlock(&meta->mutex);
+
+	return NULL;
+}
+
+size_t buddy_size(struct ARC_BuddyMeta *meta, void *address) {
+	int64_t unit = unit_of(meta, address);
+
+	if (unit < 0) {
+		return 0;
+	}
+
+	mutex_lock(&meta->mutex);
+	int order = allocated_order(meta->tree, unit);
+	mutex_unlock(&meta->mutex);
+
+	return order < 0 ? 0 : meta->smallest_object << order;
+}
+
+size_t buddy_grow(struct ARC_BuddyMeta *meta, void *address, size_t size) {
+	int64_t unit = unit_of(meta, address);
+
+	if (unit < 0) {
+		return 0;
+	}
+
+	struct buddy_tree *tree = meta->tree;
+	int target = order_of(meta, size);
+
+	if (target < 0) {
+		return 0;
+	}
+
+	mutex_lock(&meta->mutex);
+
+	int order = allocated_order(tree, unit);
+
+	if (order < 0 || order >= target) {
+		mutex_unlock(&meta->mutex);
+		return order < 0 ? 0 : meta->smallest_object << order;
+	}
+
+	// The block can only grow up if it is the lower half at every level
+	// and every upper half is free
+	for (int current = order; current < target; current++) {
+		if ((unit >> current) & 1 || !is_free(tree, current, unit + ((uint32_t)1 << current))) {
+			mutex_unlock(&meta->mutex);
+			return 0;
 		}
+	}
 
-		cycle_end:
-		current = current->next;
+	BIT_CLEAR(tree->allocated, NODE_INDEX(tree, order, unit));
+
+	for (int current = order; current < target; current++) {
+		unlink(tree, current, unit + ((uint32_t)1 << current));
+		BIT_CLEAR(tree->split, NODE_INDEX(tree, current + 1, unit));
 	}
 
-	if (current == NULL) {
-		return NULL;
+	BIT_SET(tree->allocated, NODE_INDEX(tree, target, unit));
+
+	mutex_unlock(&meta->mutex);
+
+	return meta->smallest_object << target;
+}
+
+size_t buddy_shrink(struct ARC_BuddyMeta *meta, void *address, size_t size) {
+	int64_t unit = unit_of(meta, address);
+
+	if (unit < 0) {
+		return 0;
 	}
 
-	current->attributes |= 1;
+	struct buddy_tree *tree = meta->tree;
+	int target = order_of(meta, size);
 
-        return current->base;
+	if (target < 0) {
+		return 0;
+	}
+
+	mutex_lock(&meta->mutex);
+
+	int order = allocated_order(tree, unit);
+
+	if (order < 0) {
+		mutex_unlock(&meta->mutex);
+		return 0;
+	}
+
+	if (order > target) {
+		// Split off and free the upper halves, their buddies are the
+		// lower halves kept, so none of them can merge
+		BIT_CLEAR(tree->allocated, NODE_INDEX(tree, order, unit));
+
+		for (int current = order; current > target; current--) {
+			split(tree, current, unit);
+		}
+
+		BIT_SET(tree->allocated, NODE_INDEX(tree, target, unit));
+		order = target;
+	}
+
+	mutex_unlock(&meta->mutex);
+
+	return meta->smallest_object << order;
 }
 
 size_t buddy_free(struct ARC_BuddyMeta *meta, void *address) {
-	if (meta == NULL || meta->tree == NULL) {
+	int64_t _unit = unit_of(meta, address);
+
+	if (_unit < 0) {
 		return 0;
 	}
 
-	struct buddy_node *current = meta->tree;
+	struct buddy_tree *tree = meta->tree;
+	uint32_t unit = _unit;
 
-	while (current != NULL && current->base != address) {
-		current = current->next;
-	}
+	mutex_lock(&meta->mutex);
 
-	if (current == NULL || (current->attributes & 1) == 0) {
+	int order = allocated_order(tree, unit);
+
+	if (order < 0) {
+		mutex_unlock(&meta->mutex);
 		return 0;
 	}
 
-	current->attributes &= ~1;
+	size_t node = NODE_INDEX(tree, order, unit);
+
+	BIT_CLEAR(tree->allocated, node);
+	push(tree, order, unit);
+
+	size_t ret = meta->smallest_object << order;
 
-	size_t ret = current->size;
+	// Coalesce with free buddies all the way up
+	while (merge(tree, &order, &unit) == 0);
 
-	merge(current);
+	mutex_unlock(&meta->mutex);
 
         return ret;
 }
 
-int init_buddy(struct ARC_BuddyMeta *meta, void *base, size_t size, size_t smallest_object) {
-        ARC_DEBUG(INFO, "Initializing new buddy allocator (%lu bytes, lowest %lu bytes) at %p\n", size, smallest_object, base);
+static int max_order_of(size_t units) {
+	int order = 0;
+
+	while (((size_t)1 << order) < units) {
+		order++;
+	}
+
+	return order;
+}
+
+size_t buddy_bookkeeping_size(size_t size, size_t smallest_object) {
+	if (smallest_object == 0 || size < smallest_object) {
+		return 0;
+	}
+
+	size_t units = size / smallest_object;
+	size_t bitmap_size = ((((size_t)2 << max_order_of(units)) >> 6) + 1) * sizeof(uint64_t);
+
+	return ALIGN(sizeof(struct buddy_tree), 8) + ALIGN(units * sizeof(struct buddy_link), 8) + bitmap_size * 2;
+}
+
+int init_static_buddy(struct ARC_BuddyMeta *meta, void *base, size_t size, size_t smallest_object, void *bookkeeping) {
+	if (meta == NULL || bookkeeping == NULL || smallest_object == 0 || size < smallest_object) {
+		return -1;
+	}
+
+	size_t units = size / smallest_object;
+
+	if (units >= BUDDY_NIL) {
+		ARC_DEBUG(ERR, "Too many objects (%lu)\n", units);
+		return -1;
+	}
+
+	memset(bookkeeping, 0, buddy_bookkeeping_size(size, smallest_object));
 
 	meta->base = base;
-	meta->ceil = base + size;
+	meta->ceil = base + units * smallest_object;
 	meta->smallest_object = smallest_object;
 
 	init_static_mutex(&meta->mutex);
 
-	struct buddy_node *head = (struct buddy_node *)ialloc(sizeof(*head));
+	// Bookkeeping: the tree, a link per unit, then the split and allocated bitmaps
+	struct buddy_tree *tree = (struct buddy_tree *)bookkeeping;
 
-	if (head == NULL) {
-		return -1;
+	tree->units = units;
+	tree->max_order = max_order_of(units);
+
+	size_t links_size = ALIGN(units * sizeof(struct buddy_link), 8);
+	size_t bitmap_size = ((((size_t)2 << tree->max_order) >> 6) + 1) * sizeof(uint64_t);
+
+	tree->links = (struct buddy_link *)(bookkeeping + ALIGN(sizeof(*tree), 8));
+	tree->split = (uint64_t *)((void *)tree->links + links_size);
+	tree->allocated = (uint64_t *)((void *)tree->split + bitmap_size);
+
+	for (int i = 0; i < BUDDY_MAX_ORDERS; i++) {
+		tree->free[i] = BUDDY_NIL;
 	}
 
-	memset(head, 0, sizeof(*head));
+	// Cover the units with the largest naturally aligned blocks possible,
+	// marking every ancestor of those blocks as split
+	size_t unit = 0;
+	while (unit < units) {
+		int order = unit == 0 ? tree->max_order : __builtin_ctzl(unit);
+
+		while (unit + ((size_t)1 << order) > units) {
+			order--;
+		}
+
+		for (int i = order + 1; i <= tree->max_order; i++) {
+			BIT_SET(tree->split, NODE_INDEX(tree, i, unit));
+		}
+
+		push(tree, order, unit);
+		unit += (size_t)1 << order;
+	}
 
-	head->base = base;
-	head->size = size;
-	head->next = NULL;
-	head->attributes = 0;
+	meta->tree = tree;
 
-	meta->tree = head;
+	return 0;
+}
+
+int init_buddy(struct ARC_BuddyMeta *meta, void *base, size_t size, size_t smallest_object) {
+        ARC_DEBUG(INFO, "Initializing new buddy allocator (%lu bytes, lowest %lu bytes) at %p\n", size, smallest_object, base);
+
+	size_t bookkeeping_size = buddy_bookkeeping_size(size, smallest_object);
+
+	if (meta == NULL || bookkeeping_size == 0) {
+		return -1;
+	}
+
+	size_t pages = ALIGN(bookkeeping_size, PAGE_SIZE) / PAGE_SIZE;
+	void *bookkeeping = pmm_contig_alloc(pages);
+
+	if (bookkeeping == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate %lu pages of bookkeeping\n", pages);
+		return -2;
+	}
 
-        return 0;
+	return init_static_buddy(meta, base, size, smallest_object, bookkeeping);
 }
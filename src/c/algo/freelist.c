@@ -26,6 +26,7 @@
  * Abstract freelist implementation.
 */
 #include <mm/algo/freelist.h>
+#include <mm/algo/range.h>
 #include <lib/atomics.h>
 #include <lib/util.h>
 #include <global.h>
@@ -34,29 +35,207 @@
 
 #define ADDRESS_IN_META(address, meta) ((void *)meta->base <= (void *)address && (void *)address <= (void *)meta->ceil)
 
+#define IS_LOCKFREE(meta) (((meta)->attributes & 1) == 1)
+
+// Compare and exchange head and tag as one
+// Return: 1 = exchanged
+static inline int cas_head(struct ARC_FreelistMeta *meta, struct ARC_FreelistNode *old_head, uint64_t old_tag, struct ARC_FreelistNode *new_head, uint64_t new_tag) {
+#ifdef __x86_64__
+	uint8_t exchanged = 0;
+
+	__asm__ volatile("lock cmpxchg16b %1; setz %0"
+			 : "=q"(exchanged), "+m"(*(volatile unsigned __int128 *)&meta->head), "+a"(old_head), "+d"(old_tag)
+			 : "b"(new_head), "c"(new_tag)
+			 : "memory", "cc");
+
+	return exchanged;
+#else
+	unsigned __int128 expected = ((unsigned __int128)old_tag << 64) | (uintptr_t)old_head;
+	unsigned __int128 desired = ((unsigned __int128)new_tag << 64) | (uintptr_t)new_head;
+
+	return __sync_bool_compare_and_swap((unsigned __int128 *)&meta->head, expected, desired);
+#endif
+}
+
+// Reserve up to count objects of the free count without locking. Objects are
+// only popped once reserved and only counted once pushed, so the count never
+// exceeds what the list holds
+// Return: number of objects reserved
+static uint64_t lockfree_reserve(struct ARC_FreelistMeta *meta, uint64_t count) {
+	uint64_t free_objects = __atomic_load_n(&meta->free_objects, __ATOMIC_RELAXED);
+	uint64_t reserved = 0;
+
+	do {
+		reserved = min(free_objects, count);
+
+		if (reserved == 0) {
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(&meta->free_objects, &free_objects, free_objects - reserved, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	return reserved;
+}
+
+// Take count untouched objects from the bump pointer without locking, the
+// objects must have been reserved
+// Return: non-NULL = success
+static void *lockfree_bump(struct ARC_FreelistMeta *meta, uint64_t count) {
+	struct ARC_FreelistNode *bump = __atomic_load_n(&meta->bump, __ATOMIC_ACQUIRE);
+	struct ARC_FreelistNode *next = NULL;
+
+	do {
+		next = (struct ARC_FreelistNode *)((uintptr_t)bump + count * meta->object_size);
+
+		if ((uintptr_t)next > (uintptr_t)meta->ceil + meta->object_size) {
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&meta->bump, &bump, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return (void *)bump;
+}
+
+// Pop one object without locking, the object must have been reserved
+// Return: non-NULL = success
+static void *lockfree_pop(struct ARC_FreelistMeta *meta) {
+	struct ARC_FreelistNode *head = NULL;
+	uint64_t tag = 0;
+
+	do {
+		tag = __atomic_load_n(&meta->tag, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&meta->head, __ATOMIC_ACQUIRE);
+
+		if (head == NULL) {
+			return lockfree_bump(meta, 1);
+		}
+
+		// head may be popped and reused before the exchange, in which
+		// case next is garbage but the tag will have moved on
+	} while (!cas_head(meta, head, tag, head->next, tag + 1));
+
+	return (void *)head;
+}
+
+// Push the chain first..last of count objects without locking
+static void lockfree_push(struct ARC_FreelistMeta *meta, struct ARC_FreelistNode *first, struct ARC_FreelistNode *last, uint64_t count) {
+	struct ARC_FreelistNode *head = NULL;
+	uint64_t tag = 0;
+
+	do {
+		tag = __atomic_load_n(&meta->tag, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&meta->head, __ATOMIC_ACQUIRE);
+		last->next = head;
+	} while (!cas_head(meta, head, tag, first, tag));
+
+	__atomic_add_fetch(&meta->free_objects, count, __ATOMIC_RELAXED);
+}
+
+// Take up to count objects from one list without locking
+// Return: number of objects taken
+static uint64_t lockfree_take(struct ARC_FreelistMeta *meta, void **objects, uint64_t count) {
+	uint64_t reserved = lockfree_reserve(meta, count);
+	uint64_t taken = 0;
+
+	// Freed objects first, the chain cannot be detached as a whole, as its
+	// objects would then be counted without being in the list
+	while (taken < reserved && __atomic_load_n(&meta->head, __ATOMIC_ACQUIRE) != NULL) {
+		void *address = lockfree_pop(meta);
+
+		if (address == NULL) {
+			break;
+		}
+
+		objects[taken++] = address;
+	}
+
+	// The rest is fresh, taken in one go
+	while (taken < reserved) {
+		uintptr_t bump = (uintptr_t)__atomic_load_n(&meta->bump, __ATOMIC_ACQUIRE);
+		uintptr_t end = (uintptr_t)meta->ceil + meta->object_size;
+		uint64_t fresh = min(reserved - taken, (end - min(bump, end)) / meta->object_size);
+
+		if (fresh == 0) {
+			break;
+		}
+
+		void *address = lockfree_bump(meta, fresh);
+
+		for (uint64_t i = 0; address != NULL && i < fresh; i++) {
+			objects[taken++] = address + i * meta->object_size;
+		}
+	}
+
+	if (taken < reserved) {
+		// Objects reserved were held by others for the moment
+		__atomic_add_fetch(&meta->free_objects, reserved - taken, __ATOMIC_RELAXED);
+	}
+
+	return taken;
+}
+
+// Hand the lock held on meta over to the next list of the chain
+// Return: the next list, locked, NULL if meta was the last
+static struct ARC_FreelistMeta *lock_next(struct ARC_FreelistMeta *meta) {
+	// Read next once under the lock of meta, once that is dropped the list
+	// after it may be unlinked and released by unlink_freelist
+	struct ARC_FreelistMeta *next = meta->next;
+
+	if (next != NULL) {
+		mutex_lock(&next->mutex);
+	}
+
+	mutex_unlock(&meta->mutex);
+
+	return next;
+}
+
 // Allocate one object in given list
 // Return: non-NULL = success
 void *freelist_alloc(struct ARC_FreelistMeta *meta) {
-	mutex_lock(&meta->mutex);
+	if (meta == NULL) {
+		ARC_DEBUG(ERR, "Given meta is NULL\n");
+		return NULL;
+	}
 
-	while (meta != NULL && meta->free_objects < 1) {
-		if (meta->next != NULL) {
-			mutex_lock(&meta->next->mutex);
+	if (IS_LOCKFREE(meta)) {
+		for (; meta != NULL; meta = __atomic_load_n(&meta->next, __ATOMIC_ACQUIRE)) {
+			if (lockfree_reserve(meta, 1) == 0) {
+				continue;
+			}
+
+			void *address = lockfree_pop(meta);
+
+			if (address != NULL) {
+				return address;
+			}
+
+			__atomic_add_fetch(&meta->free_objects, 1, __ATOMIC_RELAXED);
 		}
 
+		ARC_DEBUG(INFO, "Found meta is NULL\n");
+		return NULL;
+	}
 
-		mutex_unlock(&meta->mutex);
-		meta = meta->next;
+	mutex_lock(&meta->mutex);
+
+	while (meta != NULL && meta->free_objects < 1) {
+		meta = lock_next(meta);
 	}
 
-	if (meta == NULL || meta->head == NULL) {
-		ARC_DEBUG(ERR, "Found meta is NULL\n");
+	if (meta == NULL) {
+		ARC_DEBUG(INFO, "Found meta is NULL\n");
 		return NULL;
 	}
 
 	// Get address, mark as used
 	void *address = (void *)meta->head;
-	meta->head = meta->head->next;
+
+	if (address != NULL) {
+		meta->head = meta->head->next;
+	} else {
+		// Nothing has been freed, take a fresh object
+		address = (void *)meta->bump;
+		meta->bump = (struct ARC_FreelistNode *)((uintptr_t)meta->bump + meta->object_size);
+	}
 
 	meta->free_objects--;
 
@@ -66,8 +245,34 @@ void *freelist_alloc(struct ARC_FreelistMeta *meta) {
 }
 
 void *freelist_contig_alloc(struct ARC_FreelistMeta *meta, uint64_t objects) {
-	while (meta->free_objects < objects && meta != NULL) {
-		meta = meta->next;
+	if (meta != NULL && IS_LOCKFREE(meta)) {
+		// Lock-free lists can only hand out the untouched part of their
+		// regions, try each until one has enough of it left
+		for (; meta != NULL; meta = __atomic_load_n(&meta->next, __ATOMIC_ACQUIRE)) {
+			uint64_t reserved = lockfree_reserve(meta, objects);
+			void *address = NULL;
+
+			if (reserved == objects) {
+				address = lockfree_bump(meta, objects);
+			}
+
+			if (address != NULL) {
+				return address;
+			}
+
+			if (reserved != 0) {
+				__atomic_add_fetch(&meta->free_objects, reserved, __ATOMIC_RELAXED);
+			}
+		}
+
+		ARC_DEBUG(INFO, "Found meta is NULL\n");
+		return NULL;
+	}
+
+	mutex_lock(&meta->mutex);
+
+	while (meta != NULL && meta->free_objects < objects) {
+		meta = lock_next(meta);
 	}
 
 	if (meta == NULL) {
@@ -75,6 +280,19 @@ void *freelist_contig_alloc(struct ARC_FreelistMeta *meta, uint64_t objects) {
 		return NULL;
 	}
 
+	if (meta->bump <= meta->ceil && ((uintptr_t)meta->ceil - (uintptr_t)meta->bump) / meta->object_size + 1 >= objects) {
+		// The untouched part of the region is contiguous
+		void *address = (void *)meta->bump;
+		meta->bump = (struct ARC_FreelistNode *)((uintptr_t)meta->bump + objects * meta->object_size);
+		meta->free_objects -= objects;
+
+		mutex_unlock(&meta->mutex);
+
+		return address;
+	}
+
+	mutex_unlock(&meta->mutex);
+
 	struct ARC_FreelistMeta to_free = { 0 };
 	to_free.object_size = meta->object_size;
 	to_free.base = meta->base;
@@ -145,6 +363,91 @@ void *freelist_contig_alloc(struct ARC_FreelistMeta *meta, uint64_t objects) {
 	return min(base, allocation);
 }
 
+// Allocate up to count objects from the chain, each list locked once
+// Return: number of objects allocated
+uint64_t freelist_alloc_n(struct ARC_FreelistMeta *meta, uint64_t count, void **objects) {
+	if (meta == NULL || objects == NULL) {
+		ARC_DEBUG(ERR, "Given meta or object array is NULL\n");
+		return 0;
+	}
+
+	uint64_t taken = 0;
+
+	if (IS_LOCKFREE(meta)) {
+		for (; meta != NULL && taken < count; meta = __atomic_load_n(&meta->next, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&meta->free_objects, __ATOMIC_RELAXED) < 1) {
+				continue;
+			}
+
+			taken += lockfree_take(meta, &objects[taken], count - taken);
+		}
+
+		return taken;
+	}
+
+	mutex_lock(&meta->mutex);
+
+	while (1) {
+		// Freed objects first, then fresh ones, once the freed
+		// objects run out every free object is a fresh one
+		while (taken < count && meta->head != NULL) {
+			objects[taken++] = (void *)meta->head;
+			meta->head = meta->head->next;
+			meta->free_objects--;
+		}
+
+		uint64_t fresh = min(count - taken, meta->free_objects);
+
+		for (uint64_t i = 0; i < fresh; i++) {
+			objects[taken++] = (void *)meta->bump;
+			meta->bump = (struct ARC_FreelistNode *)((uintptr_t)meta->bump + meta->object_size);
+		}
+
+		meta->free_objects -= fresh;
+
+		if (taken == count || meta->next == NULL) {
+			break;
+		}
+
+		meta = lock_next(meta);
+	}
+
+	mutex_unlock(&meta->mutex);
+
+	return taken;
+}
+
+// Lock and return the meta owning address, NULL if there is none. Lock-free
+// lists are not locked
+static struct ARC_FreelistMeta *find_owner(struct ARC_FreelistMeta *meta, void *address) {
+	struct ARC_FreelistMeta *owner = range_index_find(meta->index, address);
+
+	if (owner != NULL) {
+		if (!IS_LOCKFREE(owner)) {
+			mutex_lock(&owner->mutex);
+		}
+
+		return owner;
+	}
+
+	if (IS_LOCKFREE(meta)) {
+		while (meta != NULL && !ADDRESS_IN_META(address, meta)) {
+			meta = __atomic_load_n(&meta->next, __ATOMIC_ACQUIRE);
+		}
+
+		return meta;
+	}
+
+	// Not indexed, walk the chain
+	mutex_lock(&meta->mutex);
+
+	while (meta != NULL && !ADDRESS_IN_META(address, meta)) {
+		meta = lock_next(meta);
+	}
+
+	return meta;
+}
+
 // Free given address in given list
 // Return: non-NULL = success
 void *freelist_free(struct ARC_FreelistMeta *meta, void *address) {
@@ -153,16 +456,7 @@ void *freelist_free(struct ARC_FreelistMeta *meta, void *address) {
 		return NULL;
 	}
 
-	mutex_lock(&meta->mutex);
-
-	while (meta != NULL && !ADDRESS_IN_META(address, meta)) {
-		if (meta->next != NULL) {
-			mutex_lock(&meta->next->mutex);
-		}
-
-		mutex_unlock(&meta->mutex);
-		meta = meta->next;
-	}
+	meta = find_owner(meta, address);
 
 	if (meta == NULL) {
 		ARC_DEBUG(ERR, "Could not find %p in given list\n", address);
@@ -171,6 +465,11 @@ void *freelist_free(struct ARC_FreelistMeta *meta, void *address) {
 
 	struct ARC_FreelistNode *node = (struct ARC_FreelistNode *)address;
 
+	if (IS_LOCKFREE(meta)) {
+		lockfree_push(meta, node, node, 1);
+		return address;
+	}
+
 	// Mark as free
 	node->next = meta->head;
 	meta->head = node;
@@ -182,28 +481,77 @@ void *freelist_free(struct ARC_FreelistMeta *meta, void *address) {
 	return address;
 }
 
-void *freelist_contig_free(struct ARC_FreelistMeta *meta, void *address, uint64_t objects) {
-	if (meta == NULL || address == NULL) {
-		ARC_DEBUG(ERR, "Failed to free %p in %p\n", address, meta);
-		return NULL;
+uint64_t freelist_free_n(struct ARC_FreelistMeta *meta, uint64_t count, void **objects) {
+	if (meta == NULL || objects == NULL) {
+		ARC_DEBUG(ERR, "Given meta or object array is NULL\n");
+		return 0;
 	}
 
-	mutex_lock(&meta->mutex);
+	uint64_t freed = 0;
+	uint64_t i = 0;
 
-	while (meta != NULL && !ADDRESS_IN_META(address, meta)) {
-		if (meta->next != NULL) {
-			mutex_lock(&meta->next->mutex);
+	while (i < count) {
+		struct ARC_FreelistMeta *owner = find_owner(meta, objects[i]);
+
+		if (owner == NULL) {
+			ARC_DEBUG(ERR, "Could not find %p in given list\n", objects[i]);
+			i++;
+			continue;
 		}
 
-		mutex_unlock(&meta->mutex);
-		meta = meta->next;
+		// Chain up the run of objects belonging to the same list and
+		// splice it in at once
+		struct ARC_FreelistNode *last = (struct ARC_FreelistNode *)objects[i];
+		struct ARC_FreelistNode *first = last;
+		uint64_t run = 1;
+
+		for (i++; i < count && ADDRESS_IN_META(objects[i], owner); i++, run++) {
+			struct ARC_FreelistNode *node = (struct ARC_FreelistNode *)objects[i];
+			node->next = first;
+			first = node;
+		}
+
+		if (IS_LOCKFREE(owner)) {
+			lockfree_push(owner, first, last, run);
+		} else {
+			last->next = owner->head;
+			owner->head = first;
+			owner->free_objects += run;
+
+			mutex_unlock(&owner->mutex);
+		}
+
+		freed += run;
 	}
 
+	return freed;
+}
+
+void *freelist_contig_free(struct ARC_FreelistMeta *meta, void *address, uint64_t objects) {
+	if (meta == NULL || address == NULL || objects == 0) {
+		ARC_DEBUG(ERR, "Failed to free %p in %p\n", address, meta);
+		return NULL;
+	}
+
+	meta = find_owner(meta, address);
+
 	if (meta == NULL) {
 		ARC_DEBUG(ERR, "Could not find %p in given list\n", address);
 		return NULL;
 	}
 
+	if (IS_LOCKFREE(meta)) {
+		// Chain the objects together, then splice them in at once
+		for (uint64_t i = 0; i + 1 < objects; i++) {
+			struct ARC_FreelistNode *node = (struct ARC_FreelistNode *)(address + (i * meta->object_size));
+			node->next = (struct ARC_FreelistNode *)((void *)node + meta->object_size);
+		}
+
+		lockfree_push(meta, address, address + ((objects - 1) * meta->object_size), objects);
+
+		return address;
+	}
+
 	for (uint64_t i = 0; i < objects; i++) {
 		struct ARC_FreelistNode *node = (struct ARC_FreelistNode *)(address + (i * meta->object_size));
 
@@ -238,62 +586,156 @@ int link_freelists(struct ARC_FreelistMeta *A, struct ARC_FreelistMeta *B) {
 	// Advance to the last list
 	struct ARC_FreelistMeta *last = A;
 	while (last->next != NULL) {
-		mutex_lock(&last->next->mutex);
-		mutex_unlock(&last->mutex);
-		last = last->next;
+		last = lock_next(last);
 	}
 
 	// Link A and B
 	last->next = B;
+	B->index = A->index;
+	B->attributes = A->attributes;
 
 	mutex_unlock(&last->mutex);
 
+	if (B->index != NULL && range_index_insert(B->index, B->base, B->ceil, B) != 0) {
+		ARC_DEBUG(INFO, "Could not index %p, frees into it will walk the chain\n", B);
+	}
+
 	return 0;
 }
 
-struct ARC_FreelistMeta *init_freelist(uint64_t _base, uint64_t _ceil, uint64_t _object_size) {
-	if (_base > _ceil || _object_size == 0) {
-		// Invalid parameters
-		return NULL;
+int unlink_freelist(struct ARC_FreelistMeta *A, struct ARC_FreelistMeta *B) {
+	if (A == NULL || B == NULL || A == B) {
+		return -2;
 	}
 
-	if (_ceil - _base < _object_size + sizeof(struct ARC_FreelistMeta)) {
-		// There is not enough space for one object
-		return NULL;
+	if (IS_LOCKFREE(A)) {
+		return -3;
 	}
 
-	struct ARC_FreelistMeta *meta = (struct ARC_FreelistMeta *)_base;
+	mutex_lock(&A->mutex);
+
+	// Advance to the list before B. Walkers of the chain read the next
+	// pointer of a list and take the next list's lock under the lock of the
+	// list itself, so once B is unlinked under both locks no walker can
+	// newly step onto it. A walker already holding B's lock is waited for
+	// below, and moves on through B->next, which is cleared only after it
+	struct ARC_FreelistMeta *previous = A;
+	while (previous->next != NULL && previous->next != B) {
+		previous = lock_next(previous);
+	}
+
+	if (previous->next == NULL) {
+		mutex_unlock(&previous->mutex);
+		return -1;
+	}
+
+	mutex_lock(&B->mutex);
+
+	uint64_t objects = ((uint64_t)B->ceil - (uint64_t)B->base) / B->object_size + 1;
+
+	if (B->free_objects != objects) {
+		mutex_unlock(&B->mutex);
+		mutex_unlock(&previous->mutex);
+		return -3;
+	}
+
+	previous->next = B->next;
+	B->next = NULL;
+
+	mutex_unlock(&B->mutex);
+	mutex_unlock(&previous->mutex);
+
+	if (B->index != NULL) {
+		range_index_remove(B->index, B);
+	}
+
+	return 0;
+}
+
+int freelist_set_attributes(struct ARC_FreelistMeta *meta, uint64_t attributes) {
+	if (meta == NULL) {
+		return -1;
+	}
+
+	for (; meta != NULL; meta = meta->next) {
+		meta->attributes = attributes;
+	}
+
+	return 0;
+}
+
+int freelist_attach_index(struct ARC_FreelistMeta *meta, struct ARC_RangeIndex *index) {
+	if (meta == NULL || index == NULL) {
+		return -1;
+	}
+
+	int err = 0;
+
+	for (; meta != NULL; meta = meta->next) {
+		meta->index = index;
+
+		if (range_index_insert(index, meta->base, meta->ceil, meta) != 0) {
+			err = -2;
+		}
+	}
+
+	return err;
+}
+
+int init_static_freelist(struct ARC_FreelistMeta *meta, uint64_t _base, uint64_t _ceil, uint64_t _object_size) {
+	if (meta == NULL || ((uintptr_t)meta & (ARC_FREELIST_META_ALIGN - 1)) != 0) {
+		// The head and its tag are exchanged as one, and the meta
+		// should not share cache lines with anything else
+		return -1;
+	}
+
+	if (_base > _ceil || _object_size == 0 || _ceil - _base < _object_size) {
+		// Invalid parameters, or not enough space for one object
+		return -1;
+	}
 
 	memset(meta, 0, sizeof(struct ARC_FreelistMeta));
 
 	init_static_mutex(&meta->mutex);
 
-	// Number of objects to accomodate meta
-	int objects = (sizeof(struct ARC_FreelistMeta) / _object_size) + 1;
-	_base += objects * _object_size;
-	_ceil -= _object_size;
+	uint64_t objects = (_ceil - _base) / _object_size;
+	_ceil = _base + (objects - 1) * _object_size;
 
 	struct ARC_FreelistNode *base = (struct ARC_FreelistNode *)_base;
 	struct ARC_FreelistNode *ceil = (struct ARC_FreelistNode *)_ceil;
 
-	// Store meta information
+	// Store meta information, nothing is linked until it is freed
 	meta->base = base;
-	meta->head = base;
+	meta->head = NULL;
+	meta->bump = base;
 	meta->ceil = ceil;
 	meta->object_size = _object_size;
-	meta->free_objects = (_ceil - _base) / _object_size - objects + 1;
+	meta->free_objects = objects;
 
 	ARC_DEBUG(INFO, "Creating freelist from 0x%"PRIx64" (%p) to 0x%"PRIx64" (%p) with objects of %lu bytes\n", (uint64_t)_base, base, (uint64_t)_ceil, ceil, _object_size);
 
-	// Initialize the linked list
-	struct ARC_FreelistNode *current = NULL;
-	for (; _base < _ceil; _base += _object_size) {
-		current = (struct ARC_FreelistNode *)_base;
-		*(uint64_t *)current = _base + _object_size;
+	return 0;
+}
+
+struct ARC_FreelistMeta *init_freelist(uint64_t _base, uint64_t _ceil, uint64_t _object_size) {
+	if (_base > _ceil || _object_size == 0) {
+		// Invalid parameters
+		return NULL;
+	}
+
+	// Number of objects to accomodate meta
+	uint64_t objects = (sizeof(struct ARC_FreelistMeta) + _object_size - 1) / _object_size;
+
+	if (_ceil - _base < (objects + 1) * _object_size) {
+		// There is not enough space for one object
+		return NULL;
 	}
 
-	// Set last entry to point to NULL
-	*(uint64_t *)current = 0;
+	struct ARC_FreelistMeta *meta = (struct ARC_FreelistMeta *)_base;
+
+	if (init_static_freelist(meta, _base + objects * _object_size, _ceil, _object_size) != 0) {
+		return NULL;
+	}
 
 	return meta;
 }
@@ -0,0 +1,145 @@
+/**
+ * @file pagemap.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Radix table mapping pages to values.
+*/
+#include <mm/algo/pagemap.h>
+#include <mm/pmm.h>
+#include <lib/atomics.h>
+#include <lib/util.h>
+#include <global.h>
+
+#define PAGEMAP_ENTRIES (1 << ARC_PAGEMAP_BITS)
+
+static size_t pagemap_slot(uint64_t address, int level) {
+	int shift = 12 + ARC_PAGEMAP_BITS * (ARC_PAGEMAP_LEVELS - 1 - level);
+	return (address >> shift) & (PAGEMAP_ENTRIES - 1);
+}
+
+static void **pagemap_node_alloc(struct ARC_PageMap *map) {
+	void **node = (void **)pmm_alloc();
+
+	if (node == NULL) {
+		return NULL;
+	}
+
+	memset(node, 0, PAGEMAP_ENTRIES * sizeof(void *));
+	map->nodes++;
+
+	return node;
+}
+
+void *pagemap_get(struct ARC_PageMap *map, void *address) {
+	if (map == NULL || map->root == NULL) {
+		return NULL;
+	}
+
+	uint64_t target = (uint64_t)address;
+	void **node = map->root;
+
+	for (int level = 0; level < ARC_PAGEMAP_LEVELS - 1; level++) {
+		node = __atomic_load_n((void ***)&node[pagemap_slot(target, level)], __ATOMIC_ACQUIRE);
+
+		if (node == NULL) {
+			return NULL;
+		}
+	}
+
+	return __atomic_load_n(&node[pagemap_slot(target, ARC_PAGEMAP_LEVELS - 1)], __ATOMIC_ACQUIRE);
+}
+
+int pagemap_set(struct ARC_PageMap *map, void *address, size_t pages, void *value) {
+	if (map == NULL || map->root == NULL) {
+		return -1;
+	}
+
+	uint64_t target = (uint64_t)address & ~((uint64_t)PAGE_SIZE - 1);
+	void **leaf = NULL;
+	int err = 0;
+
+	mutex_lock(&map->mutex);
+
+	for (size_t i = 0; i < pages; i++, target += PAGE_SIZE) {
+		size_t slot = pagemap_slot(target, ARC_PAGEMAP_LEVELS - 1);
+
+		if (leaf == NULL || slot == 0) {
+			// Walk to the leaf, creating the levels on the way when a
+			// value is set
+			void **node = map->root;
+
+			for (int level = 0; level < ARC_PAGEMAP_LEVELS - 1 && node != NULL; level++) {
+				void ***entry = (void ***)&node[pagemap_slot(target, level)];
+				void **next = *entry;
+
+				if (next == NULL && value != NULL) {
+					if ((next = pagemap_node_alloc(map)) == NULL) {
+						ARC_DEBUG(ERR, "Failed to grow page map %p\n", map);
+						err = -1;
+						break;
+					}
+
+					// Publish the node only once it is zeroed
+					__atomic_store_n(entry, next, __ATOMIC_RELEASE);
+				}
+
+				node = next;
+			}
+
+			if (err != 0) {
+				break;
+			}
+
+			if (node == NULL) {
+				// Clearing pages which were never set
+				leaf = NULL;
+				continue;
+			}
+
+			leaf = node;
+		}
+
+		__atomic_store_n(&leaf[slot], value, __ATOMIC_RELEASE);
+	}
+
+	mutex_unlock(&map->mutex);
+
+	return err;
+}
+
+int init_pagemap(struct ARC_PageMap *map) {
+	if (map == NULL) {
+		return -1;
+	}
+
+	init_static_mutex(&map->mutex);
+	map->nodes = 0;
+	map->root = pagemap_node_alloc(map);
+
+	if (map->root == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate page map root\n");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/**
+ * @file range.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Sorted index of non-overlapping address ranges.
+*/
+#include <mm/algo/range.h>
+#include <lib/atomics.h>
+#include <lib/util.h>
+#include <global.h>
+
+// Index of the first entry whose base is above address
+static size_t upper_bound(struct ARC_RangeIndex *index, uint64_t address) {
+	size_t low = 0;
+	size_t high = index->count;
+
+	while (low < high) {
+		size_t middle = low + ((high - low) >> 1);
+
+		if (index->entries[middle].base <= address) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+void *range_index_find(struct ARC_RangeIndex *index, void *address) {
+	if (index == NULL) {
+		return NULL;
+	}
+
+	uint64_t target = (uint64_t)address;
+	void *owner = NULL;
+	uint64_t sequence = 0;
+
+	do {
+		sequence = __atomic_load_n(&index->sequence, __ATOMIC_ACQUIRE);
+
+		if ((sequence & 1) == 1) {
+			// Modification in progress
+			continue;
+		}
+
+		owner = NULL;
+		size_t i = upper_bound(index, target);
+
+		if (i > 0 && target <= index->entries[i - 1].ceil) {
+			owner = index->entries[i - 1].owner;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((sequence & 1) == 1 || __atomic_load_n(&index->sequence, __ATOMIC_RELAXED) != sequence);
+
+	return owner;
+}
+
+int range_index_insert(struct ARC_RangeIndex *index, void *base, void *ceil, void *owner) {
+	if (index == NULL || base > ceil) {
+		return -2;
+	}
+
+	mutex_lock(&index->mutex);
+
+	if (index->count >= index->capacity) {
+		mutex_unlock(&index->mutex);
+		return -1;
+	}
+
+	size_t i = upper_bound(index, (uint64_t)base);
+
+	if ((i > 0 && index->entries[i - 1].ceil >= (uint64_t)base) || (i < index->count && index->entries[i].base <= (uint64_t)ceil)) {
+		mutex_unlock(&index->mutex);
+		return -2;
+	}
+
+	__atomic_add_fetch(&index->sequence, 1, __ATOMIC_RELEASE);
+
+	for (size_t j = index->count; j > i; j--) {
+		index->entries[j] = index->entries[j - 1];
+	}
+
+	index->entries[i].base = (uint64_t)base;
+	index->entries[i].ceil = (uint64_t)ceil;
+	index->entries[i].owner = owner;
+	index->count++;
+
+	__atomic_add_fetch(&index->sequence, 1, __ATOMIC_RELEASE);
+
+	mutex_unlock(&index->mutex);
+
+	return 0;
+}
+
+int range_index_remove(struct ARC_RangeIndex *index, void *owner) {
+	if (index == NULL) {
+		return 0;
+	}
+
+	mutex_lock(&index->mutex);
+
+	__atomic_add_fetch(&index->sequence, 1, __ATOMIC_RELEASE);
+
+	size_t kept = 0;
+	for (size_t i = 0; i < index->count; i++) {
+		if (index->entries[i].owner != owner) {
+			index->entries[kept++] = index->entries[i];
+		}
+	}
+
+	int removed = index->count - kept;
+	index->count = kept;
+
+	__atomic_add_fetch(&index->sequence, 1, __ATOMIC_RELEASE);
+
+	mutex_unlock(&index->mutex);
+
+	return removed;
+}
+
+int init_range_index(struct ARC_RangeIndex *index, struct ARC_RangeEntry *storage, size_t capacity) {
+	if (index == NULL || storage == NULL) {
+		return -1;
+	}
+
+	memset(index, 0, sizeof(*index));
+	init_static_mutex(&index->mutex);
+
+	index->entries = storage;
+	index->capacity = capacity;
+
+	return 0;
+}
@@ -29,97 +29,1138 @@
 #include <global.h>
 #include <lib/util.h>
 
+// Metas are aligned to ARC_FREELIST_META_ALIGN, which leaves room for the list
+// index in the low bits of the pointer kept in the page map
+#define SLAB_OWNER(region, list) ((void *)((uintptr_t)(region) | (uintptr_t)(list)))
+#define SLAB_OWNER_REGION(owner) ((struct ARC_FreelistMeta *)((uintptr_t)(owner) & ~(uintptr_t)(ARC_FREELIST_META_ALIGN - 1)))
+#define SLAB_OWNER_LIST(owner) ((int)((uintptr_t)(owner) & (ARC_FREELIST_META_ALIGN - 1)))
+
+static const size_t slab_default_sizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+
+// Allocate an empty magazine for the depot, from its source list or else by
+// stocking the depot with the rest of a fresh page
+static struct ARC_SlabMagazine *slab_magazine_alloc(struct ARC_SlabDepot *depot) {
+	struct ARC_SlabMagazine *magazine = NULL;
+
+	if (depot->source != NULL) {
+		// Straight from the list, never through the magazine layer itself
+		magazine = (struct ARC_SlabMagazine *)freelist_alloc(depot->source);
+	} else if ((magazine = (struct ARC_SlabMagazine *)pmm_alloc()) != NULL) {
+		mutex_lock(&depot->mutex);
+
+		for (size_t i = 1; i < PAGE_SIZE / sizeof(struct ARC_SlabMagazine); i++) {
+			magazine[i].rounds = 0;
+			magazine[i].next = depot->empty;
+			depot->empty = &magazine[i];
+			depot->empty_count++;
+		}
+
+		mutex_unlock(&depot->mutex);
+	}
+
+	if (magazine != NULL) {
+		magazine->next = NULL;
+		magazine->rounds = 0;
+	}
+
+	return magazine;
+}
+
+static struct ARC_SlabMagazine *slab_depot_take(struct ARC_SlabDepot *depot, int full) {
+	mutex_lock(&depot->mutex);
+
+	struct ARC_SlabMagazine **list = full ? &depot->full : &depot->empty;
+	struct ARC_SlabMagazine *magazine = *list;
+
+	if (magazine != NULL) {
+		*list = magazine->next;
+		magazine->next = NULL;
+
+		if (full) {
+			depot->full_count--;
+		} else {
+			depot->empty_count--;
+		}
+	}
+
+	mutex_unlock(&depot->mutex);
+
+	return magazine;
+}
+
+static void slab_depot_give(struct ARC_SlabDepot *depot, struct ARC_SlabMagazine *magazine) {
+	mutex_lock(&depot->mutex);
+
+	// Magazines only ever leave a CPU completely full or completely empty
+	if (magazine->rounds == 0) {
+		magazine->next = depot->empty;
+		depot->empty = magazine;
+		depot->empty_count++;
+	} else {
+		magazine->next = depot->full;
+		depot->full = magazine;
+		depot->full_count++;
+	}
+
+	mutex_unlock(&depot->mutex);
+}
+
+// Detach every full magazine from the depot
+// Return: the chain of full magazines, linked through next
+static struct ARC_SlabMagazine *slab_depot_drain(struct ARC_SlabDepot *depot) {
+	mutex_lock(&depot->mutex);
+
+	struct ARC_SlabMagazine *full = depot->full;
+	depot->full = NULL;
+	depot->full_count = 0;
+
+	mutex_unlock(&depot->mutex);
+
+	return full;
+}
+
+// Make the loaded magazine of the pair one with objects, swapping with the
+// previous magazine or trading an empty one for a full one at the depot
+// Return: NULL = no objects are cached anywhere
+static struct ARC_SlabMagazine *slab_magazine_reload(struct ARC_SlabDepot *depot, struct ARC_SlabMagazines *pair) {
+	struct ARC_SlabMagazine *loaded = pair->loaded;
+
+	if (loaded != NULL && loaded->rounds > 0) {
+		return loaded;
+	}
+
+	struct ARC_SlabMagazine *previous = pair->previous;
+
+	if (previous != NULL && previous->rounds > 0) {
+		pair->previous = loaded;
+		pair->loaded = previous;
+		return previous;
+	}
+
+	struct ARC_SlabMagazine *full = slab_depot_take(depot, 1);
+
+	if (full == NULL) {
+		return NULL;
+	}
+
+	if (previous != NULL) {
+		slab_depot_give(depot, previous);
+	}
+
+	pair->previous = loaded;
+	pair->loaded = full;
+
+	return full;
+}
+
+// Make the loaded magazine of the pair one with room, swapping with the
+// previous magazine or trading a full one for an empty one at the depot
+// Return: NULL = no empty magazine could be found or made
+static struct ARC_SlabMagazine *slab_magazine_unload(struct ARC_SlabDepot *depot, struct ARC_SlabMagazines *pair) {
+	struct ARC_SlabMagazine *loaded = pair->loaded;
+
+	if (loaded != NULL && loaded->rounds < ARC_SLAB_MAGAZINE_ROUNDS) {
+		return loaded;
+	}
+
+	struct ARC_SlabMagazine *previous = pair->previous;
+
+	if (previous != NULL && previous->rounds == 0) {
+		pair->previous = loaded;
+		pair->loaded = previous;
+		return previous;
+	}
+
+	struct ARC_SlabMagazine *empty = slab_depot_take(depot, 0);
+
+	if (empty == NULL && (empty = slab_magazine_alloc(depot)) == NULL) {
+		return NULL;
+	}
+
+	if (previous != NULL) {
+		slab_depot_give(depot, previous);
+	}
+
+	pair->previous = loaded;
+	pair->loaded = empty;
+
+	return empty;
+}
+
+// Take up to count objects from the pair of magazines of a CPU, locked by
+// the given mutex
+// Return: number of objects taken
+static size_t slab_magazine_pop(struct ARC_SlabDepot *depot, ARC_GenericMutex *mutex, struct ARC_SlabMagazines *pair, void **objects, size_t count) {
+	struct ARC_SlabMagazine *loaded = NULL;
+	size_t taken = 0;
+
+	mutex_lock(mutex);
+
+	while (taken < count && (loaded = slab_magazine_reload(depot, pair)) != NULL) {
+		while (taken < count && loaded->rounds > 0) {
+			objects[taken++] = loaded->objects[--loaded->rounds];
+		}
+	}
+
+	mutex_unlock(mutex);
+
+	return taken;
+}
+
+// Put up to count objects into the pair of magazines of a CPU, locked by the
+// given mutex
+// Return: number of objects put
+static size_t slab_magazine_push(struct ARC_SlabDepot *depot, ARC_GenericMutex *mutex, struct ARC_SlabMagazines *pair, void **objects, size_t count) {
+	struct ARC_SlabMagazine *loaded = NULL;
+	size_t put = 0;
+
+	mutex_lock(mutex);
+
+	while (put < count && (loaded = slab_magazine_unload(depot, pair)) != NULL) {
+		while (put < count && loaded->rounds < ARC_SLAB_MAGAZINE_ROUNDS) {
+			loaded->objects[loaded->rounds++] = objects[put++];
+		}
+	}
+
+	mutex_unlock(mutex);
+
+	return put;
+}
+
+// Take up to count objects of the list from the magazines of the calling CPU
+// Return: number of objects taken
+static size_t slab_cpu_pop(struct ARC_SlabMeta *meta, int list, void **objects, size_t count) {
+	struct ARC_SlabCpu *cpu = &meta->cpus[ARC_MM_CPU_SLOT()];
+
+	return slab_magazine_pop(&meta->depots[list], &cpu->mutex, &cpu->classes[list], objects, count);
+}
+
+// Put up to count objects of the list into the magazines of the calling CPU
+// Return: number of objects put
+static size_t slab_cpu_push(struct ARC_SlabMeta *meta, int list, void **objects, size_t count) {
+	struct ARC_SlabCpu *cpu = &meta->cpus[ARC_MM_CPU_SLOT()];
+
+	return slab_magazine_push(&meta->depots[list], &cpu->mutex, &cpu->classes[list], objects, count);
+}
+
+// Return every object of the magazine to its list, leaving it empty
+static void slab_magazine_empty(struct ARC_SlabMeta *meta, struct ARC_SlabMagazine *magazine) {
+	for (size_t i = 0; i < magazine->rounds; i++) {
+		void *owner = pagemap_get(&meta->pages, magazine->objects[i]);
+		freelist_free(SLAB_OWNER_REGION(owner), magazine->objects[i]);
+	}
+
+	magazine->rounds = 0;
+}
+
+// Grow an exhausted list according to the growth policy and allocate from it
+static void *slab_grow(struct ARC_SlabMeta *meta, int list) {
+	struct ARC_SlabGrowth *growth = &meta->growth;
+
+	if (growth->policy == ARC_SLAB_GROW_NONE) {
+		return NULL;
+	}
+
+	mutex_lock(&growth->mutex);
+
+	// Another CPU may have grown the list while this one waited
+	void *object = freelist_alloc(meta->lists[list]);
+
+	if (object != NULL) {
+		mutex_unlock(&growth->mutex);
+		return object;
+	}
+
+	size_t pages = growth->pages;
+
+	if (growth->policy == ARC_SLAB_GROW_GEOMETRIC && growth->last[list] != 0) {
+		pages = growth->last[list] << 1;
+	}
+
+	// The list must at least fit its meta and one object
+	size_t needed = ALIGN(meta->list_sizes[list] + sizeof(struct ARC_FreelistMeta), PAGE_SIZE) / PAGE_SIZE;
+
+	size_t left = SIZE_MAX;
+
+	if (growth->max_pages != 0) {
+		// The limit may have been lowered below what has grown already
+		left = growth->grown[list] >= growth->max_pages ? 0 : growth->max_pages - growth->grown[list];
+	}
+
+	pages = min(max(pages, needed), left);
+
+	if (pages < needed) {
+		// Exhausting a capped class is expected, say so only the first time
+		int first = (growth->capped & ((uint32_t)1 << list)) == 0;
+		growth->capped |= (uint32_t)1 << list;
+
+		mutex_unlock(&growth->mutex);
+
+		if (first) {
+			ARC_DEBUG(INFO, "List %d of SLAB %p reached its growth limit\n", list, meta);
+		}
+
+		return NULL;
+	}
+
+	if (slab_expand(meta, list, pages) == 0) {
+		growth->grown[list] += pages;
+		growth->last[list] = pages;
+		object = freelist_alloc(meta->lists[list]);
+	}
+
+	mutex_unlock(&growth->mutex);
+
+	if (object == NULL) {
+		ARC_DEBUG(ERR, "Failed to grow list %d of SLAB %p\n", list, meta);
+	}
+
+	return object;
+}
+
+// Allocate one object from the given list
+static void *slab_alloc_list(struct ARC_SlabMeta *meta, int list) {
+	void *object = NULL;
+
+	if (meta->cpus == NULL || slab_cpu_pop(meta, list, &object, 1) == 0) {
+		if ((object = freelist_alloc(meta->lists[list])) == NULL) {
+			object = slab_grow(meta, list);
+		}
+	}
+
+	return object;
+}
+
 void *slab_alloc(struct ARC_SlabMeta *meta, size_t size) {
-	if (size > meta->list_sizes[7]) {
+	return slab_alloc_flags(meta, size, 0);
+}
+
+void *slab_alloc_flags(struct ARC_SlabMeta *meta, size_t size, uint32_t flags) {
+	if (size > meta->list_sizes[meta->classes - 1]) {
 		// Just allocate a contiguous set of pages
 		ARC_DEBUG(ERR, "Failed to allocate size %lu\n", size);
 		return NULL;
 	}
 
-	for (int i = 0; i < 8; i++) {
-		if (size <= meta->list_sizes[i]) {
-			return freelist_alloc(meta->lists[i]);
-		}
+	int list = meta->lookup[(size + ((size_t)1 << meta->lookup_shift) - 1) >> meta->lookup_shift];
+	void *object = slab_alloc_list(meta, list);
+
+	if (object != NULL && (flags & ARC_SLAB_ZERO)) {
+		// Only what was asked for, the rest of the object is never read
+		memset(object, 0, size);
 	}
 
-	return NULL;
+	return object;
 }
 
 void *slab_free(struct ARC_SlabMeta *meta, void *address) {
-	for (int i = 0; i < 8; i++) {
-		void *base = meta->lists[i]->base;
-		void *ceil = meta->lists[i]->ceil;
+	void *owner = pagemap_get(&meta->pages, address);
 
-		if (base <= address && address <= ceil) {
-			memset(address, 0, meta->list_sizes[i]);
-			return freelist_free(meta->lists[i], address);
+	if (owner == NULL) {
+		if ((meta->attributes & 1) == 0) {
+			ARC_DEBUG(ERR, "Failed to free %p\n", address);
 		}
+
+		return NULL;
 	}
 
-	if ((meta->attributes & 1) == 0) {
-		ARC_DEBUG(ERR, "Failed to free %p\n", address);
+	int list = SLAB_OWNER_LIST(owner);
+
+	if (meta->cpus != NULL && slab_cpu_push(meta, list, &address, 1) == 1) {
+		return address;
+	}
+
+	return freelist_free(SLAB_OWNER_REGION(owner), address);
+}
+
+void *slab_free_sized(struct ARC_SlabMeta *meta, void *address, size_t size) {
+	if (address == NULL || size == 0 || size > meta->list_sizes[meta->classes - 1]) {
+		return slab_free(meta, address);
+	}
+
+	// The size must agree with the page map, or a wrong size would put the
+	// object on the magazine of another class, or a foreign address on one
+	int list = meta->lookup[(size + ((size_t)1 << meta->lookup_shift) - 1) >> meta->lookup_shift];
+	void *owner = pagemap_get(&meta->pages, address);
+
+	if (owner == NULL || SLAB_OWNER_LIST(owner) != list) {
+		if (owner != NULL) {
+			ARC_DEBUG(ERR, "%p was freed with size %lu, which is not of its class %d\n", address, size, SLAB_OWNER_LIST(owner));
+		}
+
+		return slab_free(meta, address);
 	}
 
-	return NULL;
+	if (meta->cpus != NULL && slab_cpu_push(meta, list, &address, 1) == 1) {
+		return address;
+	}
+
+	return freelist_free(SLAB_OWNER_REGION(owner), address);
+}
+
+void *slab_alloc_aligned(struct ARC_SlabMeta *meta, size_t size, size_t align) {
+	if (align == 0 || (align & (align - 1)) != 0 || align > PAGE_SIZE || size > meta->list_sizes[meta->classes - 1]) {
+		return NULL;
+	}
+
+	// Regions start on page boundaries and objects are laid out back to
+	// back, so every object of a class which is a multiple of the alignment
+	// is aligned
+	int list = meta->lookup[(size + ((size_t)1 << meta->lookup_shift) - 1) >> meta->lookup_shift];
+
+	while (list < meta->classes && (meta->list_sizes[list] & (align - 1)) != 0) {
+		list++;
+	}
+
+	if (list == meta->classes) {
+		return NULL;
+	}
+
+	return slab_alloc_list(meta, list);
+}
+
+size_t slab_size(struct ARC_SlabMeta *meta, void *address) {
+	void *owner = pagemap_get(&meta->pages, address);
+
+	if (owner == NULL) {
+		return 0;
+	}
+
+	return meta->list_sizes[SLAB_OWNER_LIST(owner)];
+}
+
+size_t slab_class_size(struct ARC_SlabMeta *meta, size_t size) {
+	if (size == 0 || size > meta->list_sizes[meta->classes - 1]) {
+		return 0;
+	}
+
+	return meta->list_sizes[meta->lookup[(size + ((size_t)1 << meta->lookup_shift) - 1) >> meta->lookup_shift]];
+}
+
+size_t slab_alloc_bulk(struct ARC_SlabMeta *meta, size_t size, size_t count, void **objects) {
+	if (size > meta->list_sizes[meta->classes - 1]) {
+		ARC_DEBUG(ERR, "Failed to allocate size %lu\n", size);
+		return 0;
+	}
+
+	int list = meta->lookup[(size + ((size_t)1 << meta->lookup_shift) - 1) >> meta->lookup_shift];
+	size_t taken = 0;
+
+	if (meta->cpus != NULL) {
+		taken = slab_cpu_pop(meta, list, objects, count);
+	}
+
+	while (taken < count) {
+		taken += freelist_alloc_n(meta->lists[list], count - taken, &objects[taken]);
+
+		if (taken == count) {
+			break;
+		}
+
+		void *object = slab_grow(meta, list);
+
+		if (object == NULL) {
+			break;
+		}
+
+		objects[taken++] = object;
+	}
+
+	return taken;
+}
+
+size_t slab_free_bulk(struct ARC_SlabMeta *meta, size_t count, void **objects) {
+	size_t freed = 0;
+	size_t i = 0;
+
+	while (i < count) {
+		void *owner = pagemap_get(&meta->pages, objects[i]);
+
+		if (owner == NULL) {
+			if ((meta->attributes & 1) == 0) {
+				ARC_DEBUG(ERR, "Failed to free %p\n", objects[i]);
+			}
+
+			i++;
+			continue;
+		}
+
+		// Handle the run of objects from the same region together
+		size_t run = 1;
+		while (i + run < count && pagemap_get(&meta->pages, objects[i + run]) == owner) {
+			run++;
+		}
+
+		size_t put = 0;
+
+		if (meta->cpus != NULL) {
+			put = slab_cpu_push(meta, SLAB_OWNER_LIST(owner), &objects[i], run);
+		}
+
+		if (put < run) {
+			put += freelist_free_n(SLAB_OWNER_REGION(owner), run - put, &objects[i + put]);
+		}
+
+		freed += put;
+		i += run;
+	}
+
+	return freed;
+}
+
+// Allocate a region of pages from the PMM for objects of the given size,
+// the list links objects through the word link bytes into each of them
+// Return: the meta of the region, NULL upon failure
+static struct ARC_FreelistMeta *slab_region_alloc(size_t pages, size_t object_size, size_t link) {
+	uint64_t base = (uint64_t)pmm_contig_alloc(pages);
+
+	if (base == 0) {
+		return NULL;
+	}
+
+	// Place the meta at the end of the region, it takes only its own size
+	// from the slack after the last object instead of whole objects from
+	// the front, which matters for multi-page objects. The objects start
+	// on the first page, so they keep its alignment
+	uint64_t ceil = base + (pages * PAGE_SIZE) - sizeof(struct ARC_FreelistMeta);
+	struct ARC_FreelistMeta *meta = (struct ARC_FreelistMeta *)ceil;
+
+	if (pages * PAGE_SIZE < sizeof(struct ARC_FreelistMeta) + object_size
+	    || init_static_freelist(meta, base + link, ceil + link, object_size) != 0) {
+		pmm_contig_free((void *)base, pages);
+		return NULL;
+	}
+
+	return meta;
+}
+
+// Run the destructor of the cache on every object of a region
+static void slab_cache_destruct(struct ARC_SlabCache *cache, struct ARC_FreelistMeta *region) {
+	if (cache->dtor == NULL) {
+		return;
+	}
+
+	for (void *node = region->base; node <= (void *)region->ceil; node += cache->stride) {
+		cache->dtor(node - cache->link);
+	}
+}
+
+// Unlink every region after the head of the list which has no allocated
+// objects and return its pages to the PMM, the caller serializes this. The
+// objects of a cache's regions are destructed first
+// Return: number of pages released
+static size_t slab_region_release(struct ARC_FreelistMeta *head, struct ARC_PageMap *map, struct ARC_SlabCache *cache) {
+	struct ARC_FreelistMeta *previous = head;
+	size_t link = cache != NULL ? cache->link : 0;
+	size_t released = 0;
+
+	while (1) {
+		mutex_lock(&previous->mutex);
+		struct ARC_FreelistMeta *region = previous->next;
+		mutex_unlock(&previous->mutex);
+
+		if (region == NULL) {
+			break;
+		}
+
+		if (unlink_freelist(head, region) != 0) {
+			previous = region;
+			continue;
+		}
+
+		if (cache != NULL) {
+			slab_cache_destruct(cache, region);
+		}
+
+		// Regions from slab_region_alloc end with their meta
+		uint64_t base = (uint64_t)region->base - link;
+		size_t pages = ALIGN((uint64_t)region + sizeof(struct ARC_FreelistMeta) - base, PAGE_SIZE) / PAGE_SIZE;
+
+		if (map != NULL) {
+			pagemap_set(map, (void *)base, pages, NULL);
+		}
+
+		pmm_contig_free((void *)base, pages);
+		released += pages;
+	}
+
+	return released;
 }
 
 int slab_expand(struct ARC_SlabMeta *slab, int list, size_t pages) {
-	if (slab == NULL || list < 0 || list > 7 || pages == 0) {
+	if (slab == NULL || list < 0 || list >= slab->classes || pages == 0) {
 		return -1;
 	}
 
-	uint64_t base = (uint64_t)pmm_contig_alloc(pages);
-	struct ARC_FreelistMeta *meta = init_freelist(base, base + (pages * PAGE_SIZE), slab->list_sizes[list]);
+	struct ARC_FreelistMeta *meta = slab_region_alloc(pages, slab->list_sizes[list], 0);
+
+	if (meta == NULL) {
+		return -1;
+	}
+
+	void *base = meta->base;
+
+	if (pagemap_set(&slab->pages, base, pages, SLAB_OWNER(meta, list)) != 0) {
+		pagemap_set(&slab->pages, base, pages, NULL);
+		pmm_contig_free(base, pages);
+		return -1;
+	}
 
 	ARC_DEBUG(INFO, "Expanding SLAB %p (%d) by %lu pages\n", slab, list, pages);
 
 	return link_freelists(slab->lists[list], meta);
 }
 
-void *init_slab(struct ARC_SlabMeta *meta, void *range, size_t range_size, uint32_t attributes) {
+int slab_set_growth(struct ARC_SlabMeta *slab, int policy, size_t pages, size_t max_pages) {
+	if (slab == NULL || policy < ARC_SLAB_GROW_NONE || policy > ARC_SLAB_GROW_GEOMETRIC) {
+		return -1;
+	}
+
+	if (policy != ARC_SLAB_GROW_NONE && pages == 0) {
+		return -1;
+	}
+
+	mutex_lock(&slab->growth.mutex);
+
+	slab->growth.policy = policy;
+	slab->growth.pages = pages;
+	slab->growth.max_pages = max_pages;
+	slab->growth.capped = 0;
+
+	mutex_unlock(&slab->growth.mutex);
+
+	return 0;
+}
+
+size_t slab_shrink(struct ARC_SlabMeta *slab) {
+	if (slab == NULL) {
+		return 0;
+	}
+
+	// Magazines keep their objects counted as allocated, so regions are only
+	// seen as empty once their objects leave the magazines. Only the full
+	// magazines idling in the depots are emptied, the ones loaded on CPUs
+	// are left for the allocations to come, and the emptied magazines stay
+	// in the depots for the frees to come
+	for (int list = 0; slab->cpus != NULL && list < slab->classes; list++) {
+		struct ARC_SlabMagazine *full = slab_depot_drain(&slab->depots[list]);
+
+		while (full != NULL) {
+			struct ARC_SlabMagazine *next = full->next;
+			slab_magazine_empty(slab, full);
+			slab_depot_give(&slab->depots[list], full);
+			full = next;
+		}
+	}
+
+	if ((slab->attributes >> 1) & 1) {
+		return 0;
+	}
+
+	size_t released = 0;
+
+	// Regions are only ever unlinked here, under this lock, so the list
+	// walked into is not released under the walk
+	mutex_lock(&slab->growth.mutex);
+
+	for (int list = 0; list < slab->classes; list++) {
+		size_t pages = slab_region_release(slab->lists[list], &slab->pages, NULL);
+
+		released += pages;
+		slab->growth.grown[list] -= min(pages, slab->growth.grown[list]);
+
+		if (pages > 0) {
+			// The class has room to grow again
+			slab->growth.capped &= ~((uint32_t)1 << list);
+		}
+
+		if (slab->growth.grown[list] == 0) {
+			// Start growing from the initial step again
+			slab->growth.last[list] = 0;
+		}
+	}
+
+	mutex_unlock(&slab->growth.mutex);
+
+	if (released > 0) {
+		ARC_DEBUG(INFO, "Shrunk SLAB %p by %lu pages\n", slab, released);
+	}
+
+	return released;
+}
+
+// Construct every object of a region, which is not yet linked into the cache
+static void slab_cache_construct(struct ARC_SlabCache *cache, struct ARC_FreelistMeta *region) {
+	if (cache->ctor == NULL) {
+		return;
+	}
+
+	for (void *node = region->base; node <= (void *)region->ceil; node += cache->stride) {
+		void *object = node - cache->link;
+
+		if (cache->flags & ARC_SLAB_ZERO) {
+			memset(object, 0, cache->object_size);
+		}
+
+		cache->ctor(object);
+	}
+}
+
+// Give every object of the magazine back to the list of the cache, leaving
+// the magazine empty
+static void slab_cache_magazine_empty(struct ARC_SlabCache *cache, struct ARC_SlabMagazine *magazine) {
+	for (size_t i = 0; i < magazine->rounds; i++) {
+		magazine->objects[i] += cache->link;
+	}
+
+	freelist_free_n(&cache->list, magazine->rounds, magazine->objects);
+	magazine->rounds = 0;
+}
+
+// Grow an exhausted cache by twice its previous growth and allocate from it
+// Return: the list node of an object, NULL if the cache could not grow
+static void *slab_cache_grow(struct ARC_SlabCache *cache) {
+	mutex_lock(&cache->mutex);
+
+	// Another CPU may have grown the cache while this one waited
+	void *node = freelist_alloc(&cache->list);
+
+	if (node != NULL) {
+		mutex_unlock(&cache->mutex);
+		return node;
+	}
+
+	// The index must hold every region, or objects could not be told apart
+	// from foreign ones
+	if (cache->index.count < cache->index.capacity) {
+		size_t pages = cache->last != 0 ? cache->last << 1 : cache->pages;
+		struct ARC_FreelistMeta *region = slab_region_alloc(pages, cache->stride, cache->link);
+
+		if (region != NULL) {
+			// Constructed before any other CPU can reach them
+			slab_cache_construct(cache, region);
+		}
+
+		if (region != NULL && link_freelists(&cache->list, region) == 0) {
+			cache->grown += pages;
+			cache->last = pages;
+			node = freelist_alloc(&cache->list);
+		} else if (region != NULL) {
+			slab_cache_destruct(cache, region);
+			pmm_contig_free(region->base - cache->link, pages);
+		}
+	}
+
+	mutex_unlock(&cache->mutex);
+
+	return node;
+}
+
+void *slab_cache_alloc(struct ARC_SlabCache *cache) {
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	struct ARC_SlabCacheCpu *cpu = cache->cpus != NULL ? &cache->cpus[ARC_MM_CPU_SLOT()] : NULL;
+	void *object = NULL;
+
+	if (cpu == NULL || slab_magazine_pop(&cache->depot, &cpu->mutex, &cpu->magazines, &object, 1) == 0) {
+		void *node = freelist_alloc(&cache->list);
+
+		if (node == NULL) {
+			node = slab_cache_grow(cache);
+		}
+
+		object = node != NULL ? node - cache->link : NULL;
+	}
+
+	if (object == NULL) {
+		__atomic_add_fetch(&cache->stats.failures, 1, __ATOMIC_RELAXED);
+		ARC_DEBUG(ERR, "Failed to allocate from cache %s\n", cache->name);
+		return NULL;
+	}
+
+	if (cache->ctor == NULL && (cache->flags & ARC_SLAB_ZERO)) {
+		// Objects of a cache with a constructor are only zeroed before
+		// they are constructed
+		memset(object, 0, cache->stride);
+	}
+
+	__atomic_add_fetch(&cache->stats.allocs, 1, __ATOMIC_RELAXED);
+	uint64_t active = __atomic_add_fetch(&cache->stats.active, 1, __ATOMIC_RELAXED);
+	uint64_t peak = __atomic_load_n(&cache->stats.peak, __ATOMIC_RELAXED);
+
+	while (active > peak && !__atomic_compare_exchange_n(&cache->stats.peak, &peak, active, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return object;
+}
+
+void *slab_cache_free(struct ARC_SlabCache *cache, void *object) {
+	if (cache == NULL || object == NULL) {
+		return NULL;
+	}
+
+	void *node = object + cache->link;
+	struct ARC_FreelistMeta *region = range_index_find(&cache->index, node);
+
+	if (region == NULL || (uintptr_t)(node - (void *)region->base) % cache->stride != 0) {
+		ARC_DEBUG(ERR, "%p does not belong to cache %s\n", object, cache->name);
+		return NULL;
+	}
+
+	struct ARC_SlabCacheCpu *cpu = cache->cpus != NULL ? &cache->cpus[ARC_MM_CPU_SLOT()] : NULL;
+	void *ret = object;
+
+	if (cpu == NULL || slab_magazine_push(&cache->depot, &cpu->mutex, &cpu->magazines, &object, 1) == 0) {
+		ret = freelist_free(region, node) != NULL ? object : NULL;
+	}
+
+	if (ret != NULL) {
+		__atomic_add_fetch(&cache->stats.frees, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&cache->stats.active, 1, __ATOMIC_RELAXED);
+	}
+
+	return ret;
+}
+
+size_t slab_cache_shrink(struct ARC_SlabCache *cache) {
+	if (cache == NULL) {
+		return 0;
+	}
+
+	// As with slab_shrink, only the full magazines in the depot are emptied
+	struct ARC_SlabMagazine *full = slab_depot_drain(&cache->depot);
+
+	while (full != NULL) {
+		struct ARC_SlabMagazine *next = full->next;
+
+		slab_cache_magazine_empty(cache, full);
+		slab_depot_give(&cache->depot, full);
+
+		full = next;
+	}
+
+	if ((cache->attributes >> 1) & 1) {
+		return 0;
+	}
+
+	mutex_lock(&cache->mutex);
+
+	size_t released = slab_region_release(&cache->list, NULL, cache);
+
+	cache->grown -= min(released, cache->grown);
+
+	if (cache->grown == 0) {
+		cache->last = 0;
+	}
+
+	mutex_unlock(&cache->mutex);
+
+	if (released > 0) {
+		ARC_DEBUG(INFO, "Shrunk cache %s by %lu pages\n", cache->name, released);
+	}
+
+	return released;
+}
+
+int slab_cache_destroy(struct ARC_SlabCache *cache) {
+	if (cache == NULL) {
+		return -1;
+	}
+
+	uint64_t active = __atomic_load_n(&cache->stats.active, __ATOMIC_RELAXED);
+
+	if (active != 0) {
+		ARC_DEBUG(ERR, "Cannot destroy cache %s, %lu objects are still allocated\n", cache->name, active);
+		return -1;
+	}
+
+	// Gather every magazine, the objects they hold are destructed with the
+	// regions below
+	struct ARC_SlabMagazine *magazines = NULL;
+
+	for (int i = 0; cache->cpus != NULL && i < ARC_MM_MAX_CPUS; i++) {
+		struct ARC_SlabMagazine *pair[2] = { cache->cpus[i].magazines.loaded, cache->cpus[i].magazines.previous };
+
+		for (int j = 0; j < 2; j++) {
+			if (pair[j] != NULL) {
+				pair[j]->next = magazines;
+				magazines = pair[j];
+			}
+		}
+	}
+
+	struct ARC_SlabMagazine *lists[2] = { cache->depot.full, cache->depot.empty };
+
+	for (int j = 0; j < 2; j++) {
+		while (lists[j] != NULL) {
+			struct ARC_SlabMagazine *next = lists[j]->next;
+			lists[j]->next = magazines;
+			magazines = lists[j];
+			lists[j] = next;
+		}
+	}
+
+	// Magazines are carved out of whole pages, the first magazine of each
+	// page heads it, so the pages are collected before any is released
+	struct ARC_SlabMagazine *pages = NULL;
+
+	while (magazines != NULL) {
+		struct ARC_SlabMagazine *next = magazines->next;
+
+		if (((uintptr_t)magazines & (PAGE_SIZE - 1)) == 0) {
+			magazines->next = pages;
+			pages = magazines;
+		}
+
+		magazines = next;
+	}
+
+	while (pages != NULL) {
+		struct ARC_SlabMagazine *next = pages->next;
+		pmm_free(pages);
+		pages = next;
+	}
+
+	if (cache->cpus != NULL) {
+		pmm_contig_free(cache->cpus, ALIGN(sizeof(struct ARC_SlabCacheCpu) * ARC_MM_MAX_CPUS, PAGE_SIZE) / PAGE_SIZE);
+	}
+
+	// Nothing is allocated, so every region goes, lock-free or not
+	struct ARC_FreelistMeta *region = cache->list.next;
+
+	while (region != NULL) {
+		struct ARC_FreelistMeta *next = region->next;
+		void *base = (void *)region->base - cache->link;
+
+		slab_cache_destruct(cache, region);
+		pmm_contig_free(base, ALIGN((uintptr_t)region + sizeof(struct ARC_FreelistMeta) - (uintptr_t)base, PAGE_SIZE) / PAGE_SIZE);
+
+		region = next;
+	}
+
+	slab_cache_destruct(cache, &cache->list);
+	pmm_contig_free((void *)cache->list.base - cache->link, cache->pages);
+
+	ARC_DEBUG(INFO, "Destroyed cache %s\n", cache->name);
+
+	memset(cache, 0, sizeof(*cache));
+
+	return 0;
+}
+
+int init_slab_cache(struct ARC_SlabCache *cache, const char *name, size_t object_size, size_t align, void (*ctor)(void *), void (*dtor)(void *), uint32_t flags, size_t pages, uint32_t attributes) {
+	if (align == 0) {
+		align = 8;
+	}
+
+	if (cache == NULL || object_size == 0 || pages == 0 || align < 8 || align > PAGE_SIZE || (align & (align - 1)) != 0) {
+		ARC_DEBUG(ERR, "Invalid cache parameters\n");
+		return -1;
+	}
+
+	memset(cache, 0, sizeof(*cache));
+
+	cache->name = name;
+	cache->object_size = object_size;
+	cache->align = align;
+	cache->ctor = ctor;
+	cache->dtor = dtor;
+	cache->flags = flags;
+	cache->attributes = attributes;
+	cache->pages = pages;
+
+	// Regions start on page boundaries and objects are laid out back to
+	// back, so a stride of the alignment aligns every object. Constructed
+	// state lives on in free objects, so the list links them through a
+	// word of their own after the object instead of over its start
+	if (ctor != NULL || dtor != NULL) {
+		cache->link = ALIGN(object_size, sizeof(struct ARC_FreelistNode));
+		cache->stride = ALIGN(cache->link + sizeof(struct ARC_FreelistNode), align);
+	} else {
+		cache->stride = ALIGN(object_size, align);
+	}
+
+	init_static_mutex(&cache->mutex);
+	init_static_mutex(&cache->depot.mutex);
+	init_range_index(&cache->index, cache->regions, ARC_SLAB_CACHE_REGIONS);
+
+	uint64_t range = (uint64_t)pmm_contig_alloc(pages);
+
+	if (range == 0) {
+		ARC_DEBUG(ERR, "Failed to allocate range for cache %s\n", name);
+		return -1;
+	}
+
+	// The first region keeps its meta in the cache, off of the objects
+	if (init_static_freelist(&cache->list, range + cache->link, range + pages * PAGE_SIZE + cache->link, cache->stride) != 0
+	    || freelist_attach_index(&cache->list, &cache->index) != 0) {
+		ARC_DEBUG(ERR, "Failed to initialize list of cache %s\n", name);
+		pmm_contig_free((void *)range, pages);
+		return -1;
+	}
+
+	slab_cache_construct(cache, &cache->list);
+
+	if ((attributes >> 2) & 1) {
+		size_t cpu_pages = ALIGN(sizeof(struct ARC_SlabCacheCpu) * ARC_MM_MAX_CPUS, PAGE_SIZE) / PAGE_SIZE;
+		struct ARC_SlabCacheCpu *cpus = (struct ARC_SlabCacheCpu *)pmm_contig_alloc(cpu_pages);
+
+		if (cpus != NULL) {
+			memset(cpus, 0, cpu_pages * PAGE_SIZE);
+
+			for (int i = 0; i < ARC_MM_MAX_CPUS; i++) {
+				init_static_mutex(&cpus[i].mutex);
+			}
+
+			// Magazines are carved out of pages of their own, never out
+			// of the objects, which would then be neither constructed
+			// nor releasable
+			cache->depot.source = NULL;
+			cache->cpus = cpus;
+		} else {
+			ARC_DEBUG(ERR, "Failed to allocate magazines, continuing without them\n");
+		}
+	}
+
+	if ((attributes >> 1) & 1) {
+		freelist_set_attributes(&cache->list, 1);
+	}
+
+	ARC_DEBUG(INFO, "Initialized cache %s of %lu byte objects (stride %lu)\n", name, object_size, cache->stride);
+
+	return 0;
+}
+
+// Build the table mapping a rounded up size to the smallest class which fits it
+static void slab_build_lookup(struct ARC_SlabMeta *meta) {
+	// Use the coarsest granularity every class is a multiple of, so that
+	// rounding a size up never skips past a class, unless the table would
+	// not reach the largest class
+	int shift = __builtin_ctzl(meta->list_sizes[0]);
+
+	for (int i = 1; i < meta->classes; i++) {
+		shift = min(shift, __builtin_ctzl(meta->list_sizes[i]));
+	}
+
+	size_t largest = meta->list_sizes[meta->classes - 1];
+
+	while (((largest + ((size_t)1 << shift) - 1) >> shift) > ARC_SLAB_LOOKUP_ENTRIES) {
+		shift++;
+	}
+
+	meta->lookup_shift = shift;
+
+	int list = 0;
+	for (size_t i = 0; i <= ARC_SLAB_LOOKUP_ENTRIES; i++) {
+		size_t size = i << shift;
+
+		while (list < meta->classes - 1 && meta->list_sizes[list] < size) {
+			list++;
+		}
+
+		meta->lookup[i] = list;
+	}
+}
+
+void *init_slab(struct ARC_SlabMeta *meta, void *range, size_t range_size, const size_t *sizes, int classes, uint32_t attributes) {
 	ARC_DEBUG(INFO, "Initializing SLAB allocator in range %p (%lu)\n", range, range_size);
 
-	size_t partition_size = range_size >> 3;
-	size_t object_size = 16;
+	if (sizes == NULL) {
+		sizes = slab_default_sizes;
+		classes = sizeof(slab_default_sizes) / sizeof(*slab_default_sizes);
+	}
+
+	if (meta == NULL || classes <= 0 || classes > ARC_SLAB_MAX_CLASSES) {
+		ARC_DEBUG(ERR, "Invalid number of size classes %d\n", classes);
+		return NULL;
+	}
+
+	for (int i = 0; i < classes; i++) {
+		if (sizes[i] < sizeof(struct ARC_FreelistNode) || (sizes[i] & 7) != 0 || (i > 0 && sizes[i] <= sizes[i - 1])) {
+			ARC_DEBUG(ERR, "Invalid size class %lu\n", sizes[i]);
+			return NULL;
+		}
+	}
+
+	size_t partition_size = range_size / classes;
 	uint64_t base = (uint64_t)range;
 
-	meta->lists[0] = init_freelist(base, base + partition_size, object_size);
-	meta->list_sizes[0] = object_size;
-	object_size <<= 1;
-	base += partition_size;
-	meta->lists[1] = init_freelist(base, base + partition_size, object_size);
-	meta->list_sizes[1] = object_size;
-	object_size <<= 1;
-	base += partition_size;
-	meta->lists[2] = init_freelist(base, base + partition_size, object_size);
-	meta->list_sizes[2] = object_size;
-	object_size <<= 1;
-	base += partition_size;
-	meta->lists[3] = init_freelist(base, base + partition_size, object_size);
-	meta->list_sizes[3] = object_size;
-	object_size <<= 1;
-	base += partition_size;
-	meta->lists[4] = init_freelist(base, base + partition_size, object_size);
-	meta->list_sizes[4] = object_size;
-	object_size <<= 1;
-	base += partition_size;
-	meta->lists[5] = init_freelist(base, base + partition_size, object_size);
-	meta->list_sizes[5] = object_size;
-	object_size <<= 1;
-	base += partition_size;
-	meta->lists[6] = init_freelist(base, base + partition_size, object_size);
-	meta->list_sizes[6] = object_size;
-	object_size <<= 1;
-	base += partition_size;
-	meta->lists[7] = init_freelist(base, base + partition_size, object_size);
-	meta->list_sizes[7] = object_size;
-	object_size <<= 1;
-	base += partition_size;
+	if (((uint64_t)range | partition_size) & (PAGE_SIZE - 1)) {
+		// Every page must belong to a single list
+		ARC_DEBUG(ERR, "Lists are not page aligned\n");
+		return NULL;
+	}
+
+	if (init_pagemap(&meta->pages) != 0) {
+		return NULL;
+	}
+
+	for (int i = 0; i < classes; i++) {
+		// The initial lists keep their metas in the SLAB meta, off of the
+		// cache lines handed out to users
+		if (init_static_freelist(&meta->list_metas[i], base, base + partition_size, sizes[i]) != 0) {
+			ARC_DEBUG(ERR, "Failed to initialize list %d\n", i);
+			return NULL;
+		}
+
+		if (pagemap_set(&meta->pages, (void *)base, partition_size / PAGE_SIZE, SLAB_OWNER(&meta->list_metas[i], i)) != 0) {
+			return NULL;
+		}
+
+		meta->lists[i] = &meta->list_metas[i];
+		meta->list_sizes[i] = sizes[i];
+		base += partition_size;
+	}
+
+	meta->classes = classes;
+	slab_build_lookup(meta);
 
 	meta->range = range;
 	meta->range_length = range_size;
 	meta->attributes = attributes;
 
+	memset(&meta->growth, 0, sizeof(meta->growth));
+	init_static_mutex(&meta->growth.mutex);
+
+	for (int i = 0; i < classes; i++) {
+		init_static_mutex(&meta->depots[i].mutex);
+		meta->depots[i].source = NULL;
+
+		// Magazines come from the smallest list which fits one
+		for (int j = 0; j < classes; j++) {
+			if (sizes[j] >= sizeof(struct ARC_SlabMagazine)) {
+				meta->depots[i].source = meta->lists[j];
+				break;
+			}
+		}
+	}
+
+	meta->cpus = NULL;
+
+	if ((attributes >> 2) & 1) {
+		size_t pages = ALIGN(sizeof(struct ARC_SlabCpu) * ARC_MM_MAX_CPUS, PAGE_SIZE) / PAGE_SIZE;
+		struct ARC_SlabCpu *cpus = (struct ARC_SlabCpu *)pmm_contig_alloc(pages);
+
+		if (cpus != NULL) {
+			memset(cpus, 0, pages * PAGE_SIZE);
+
+			for (int i = 0; i < ARC_MM_MAX_CPUS; i++) {
+				init_static_mutex(&cpus[i].mutex);
+			}
+
+			meta->cpus = cpus;
+		} else {
+			ARC_DEBUG(ERR, "Failed to allocate magazines, continuing without them\n");
+		}
+	}
+
+	if ((attributes >> 1) & 1) {
+		for (int i = 0; i < classes; i++) {
+			freelist_set_attributes(meta->lists[i], 1);
+		}
+	}
+
 	ARC_DEBUG(INFO, "Initialized SLAB allocator\n");
 
 	return (void *)base;
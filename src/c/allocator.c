@@ -27,33 +27,188 @@
 */
 #include <mm/allocator.h>
 #include <mm/algo/slab.h>
+#include <mm/algo/pagemap.h>
+#include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <global.h>
+#include <lib/util.h>
 
 static struct ARC_SlabMeta meta = { 0 };
+static struct ARC_SlabMeta medium = { 0 };
+// Number of pages of each large allocation taken from the HHDM, set on its
+// first page
+static struct ARC_PageMap large = { 0 };
+
+// Steps of a quarter to a half between powers of two, so that no request
+// wastes more than a third of its object
+static const size_t size_classes[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+#define SIZE_CLASSES (int)(sizeof(size_classes) / sizeof(*size_classes))
+
+// Quarter steps between powers of two, served from multi-page objects in
+// regions which are mapped once, instead of rounding up to a power of two
+// of freshly mapped pages in the VMM
+static const size_t medium_classes[] = {
+	2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192, 10240, 12288,
+	14336, 16384, 20480, 24576, 28672, 32768, 40960, 49152, 57344, 65536
+};
+
+#define MEDIUM_CLASSES (int)(sizeof(medium_classes) / sizeof(*medium_classes))
+#define MEDIUM_MAX 65536
+// Pages each medium class starts with and grows by at first, enough to hold
+// the largest object
+#define MEDIUM_PAGES (MEDIUM_MAX / PAGE_SIZE)
+
+// SLAB serving the given size, NULL if it is left to the VMM
+static inline struct ARC_SlabMeta *slab_for(size_t size) {
+	if (size <= PAGE_SIZE / 2) {
+		return &meta;
+	}
+
+	if (size <= MEDIUM_MAX) {
+		return &medium;
+	}
+
+	return NULL;
+}
+
+// The initial ranges of both SLABs are carved out of the VMM's as one, the
+// regions they grow by and large allocations come from the PMM and so lie in
+// the HHDM, outside of the VMM's range. Whatever else is in the VMM's range
+// was allocated from the VMM
+// Return: the SLAB owning the address, NULL if it belongs to the VMM or is a
+//         large allocation in the HHDM, in which case *pages is set to its size
+static inline struct ARC_SlabMeta *slab_of(void *address, size_t *pages) {
+	*pages = 0;
+
+	if (vmm_contains(address)) {
+		if (address >= meta.range && address < medium.range + medium.range_length) {
+			return address < medium.range ? &meta : &medium;
+		}
+
+		return NULL;
+	}
+
+	if (slab_size(&meta, address) != 0) {
+		return &meta;
+	}
+
+	if (slab_size(&medium, address) != 0) {
+		return &medium;
+	}
+
+	*pages = (size_t)pagemap_get(&large, address);
+
+	return NULL;
+}
+
+// Allocate whole pages from the PMM, they are mapped through the HHDM
+// already, so neither the allocation nor its free touches the page tables.
+// Mapping pages in the VMM is left to when the PMM has no run of them, the
+// per-CPU page caches are not drained to make one
+static void *large_alloc(size_t size, size_t align) {
+	size_t pages = ALIGN(size, PAGE_SIZE) / PAGE_SIZE;
+	void *address = pmm_try_contig_alloc_aligned(pages, align);
+
+	if (address != NULL) {
+		if (pagemap_set(&large, address, 1, (void *)pages) == 0) {
+			return address;
+		}
+
+		pmm_contig_free(address, pages);
+	}
+
+	if (align != 0) {
+		return vmm_alloc_aligned(max(PAGE_SIZE, size), align);
+	}
+
+	return vmm_alloc(max(PAGE_SIZE, size));
+}
+
+static void *large_free(void *address, size_t pages) {
+	if (((uintptr_t)address & (PAGE_SIZE - 1)) != 0 || pagemap_set(&large, address, 1, NULL) != 0) {
+		return NULL;
+	}
+
+	return pmm_contig_free(address, pages);
+}
 
 void *alloc(size_t size) {
-	if (size > PAGE_SIZE / 2) {
-		return vmm_alloc(max(PAGE_SIZE, size));
+	struct ARC_SlabMeta *slab = slab_for(size);
+
+	if (slab == &meta) {
+		return slab_alloc(&meta, size);
+	}
+
+	if (slab == &medium) {
+		void *address = slab_alloc(&medium, size);
+
+		if (address != NULL) {
+			return address;
+		}
+	}
+
+	return large_alloc(size, 0);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		ARC_DEBUG(ERR, "Alignment %lu is not a power of two\n", alignment);
+		return NULL;
 	}
 
-	return slab_alloc(&meta, size);
+	struct ARC_SlabMeta *slab = slab_for(size);
+
+	if (slab != NULL && alignment <= PAGE_SIZE) {
+		void *address = slab_alloc_aligned(slab, size, alignment);
+
+		if (address != NULL) {
+			return address;
+		}
+	}
+
+	return large_alloc(size, alignment);
 }
 
 void *calloc(size_t size, size_t count) {
 	size_t final = size * count;
 
-	if (final > PAGE_SIZE / 2) {
-		return vmm_alloc(max(PAGE_SIZE, size));
+	if (count != 0 && final / count != size) {
+		ARC_DEBUG(ERR, "Overflow in calloc (%lu * %lu)\n", size, count);
+		return NULL;
+	}
+
+	struct ARC_SlabMeta *slab = slab_for(final);
+
+	if (slab != NULL) {
+		void *address = slab_alloc_flags(slab, final, ARC_SLAB_ZERO);
+
+		if (address != NULL || slab == &meta) {
+			return address;
+		}
 	}
 
-	return slab_alloc(&meta, final);
+	void *address = large_alloc(final, 0);
+
+	if (address != NULL) {
+		memset(address, 0, final);
+	}
+
+	return address;
 }
 
 void *free(void *address) {
-	void *ret = slab_free(&meta, address);
+	void *ret = NULL;
+	size_t pages = 0;
+	struct ARC_SlabMeta *slab = slab_of(address, &pages);
 
-	if (ret == NULL && address != NULL) {
+	if (slab != NULL) {
+		ret = slab_free(slab, address);
+	} else if (pages != 0) {
+		ret = large_free(address, pages);
+	} else {
 		ret = vmm_free(address);
 	}
 
@@ -64,32 +219,178 @@ void *free(void *address) {
 	return ret;
 }
 
+void *free_sized(void *address, size_t size) {
+	if (address == NULL || size == 0) {
+		return free(address);
+	}
+
+	if (slab_for(size) != &meta) {
+		// Larger sizes may be in the medium SLAB, the HHDM or the VMM, as
+		// each falls back to the next and blocks keep their place when
+		// shrunk, which the address tells apart
+		return free(address);
+	}
+
+	void *ret = slab_free_sized(&meta, address, size);
+
+	if (ret == NULL) {
+		ARC_DEBUG(ERR, "Failed to free %p (%lu B)\n", address, size);
+	}
+
+	return ret;
+}
+
+size_t alloc_usable_size(void *address) {
+	if (address == NULL) {
+		return 0;
+	}
+
+	size_t pages = 0;
+	struct ARC_SlabMeta *slab = slab_of(address, &pages);
+
+	if (slab != NULL) {
+		return slab_size(slab, address);
+	}
+
+	if (pages != 0) {
+		return pages * PAGE_SIZE;
+	}
+
+	return vmm_size(address);
+}
+
 void *realloc(void *address, size_t size) {
-	(void)address;
-	(void)size;
+	if (address == NULL) {
+		return alloc(size);
+	}
 
-	ARC_DEBUG(ERR, "Unimplemented Arc_Realloc\n");
+	if (size == 0) {
+		free(address);
+		return NULL;
+	}
 
-	return NULL;
+	size_t old = alloc_usable_size(address);
+
+	if (old == 0) {
+		ARC_DEBUG(ERR, "Failed to find %p\n", address);
+		return NULL;
+	}
+
+	size_t pages = 0;
+	struct ARC_SlabMeta *slab = slab_of(address, &pages);
+
+	if (slab != NULL) {
+		if (slab == slab_for(size) && slab_class_size(slab, size) == old) {
+			// Still in the object's class, which free_sized would derive
+			// from the new size
+			return address;
+		}
+	} else if (pages != 0) {
+		size_t needed = ALIGN(size, PAGE_SIZE) / PAGE_SIZE;
+
+		// The pages after the run may be in use, only shrinking happens
+		// in place
+		if (slab_for(size) == NULL && needed <= pages) {
+			if (needed < pages) {
+				pagemap_set(&large, address, 1, (void *)needed);
+				pmm_contig_free(address + needed * PAGE_SIZE, pages - needed);
+			}
+
+			return address;
+		}
+	} else if (size > PAGE_SIZE / 2) {
+		// Stay in the block, giving back or taking in buddies
+		if (size <= old) {
+			return vmm_shrink(address, size);
+		}
+
+		// Grows in place if it can, otherwise moves the pages instead of
+		// their contents
+		void *new = vmm_remap(address, size);
+
+		if (new != NULL) {
+			return new;
+		}
+	}
+
+	// Only copy when moving between classes or allocators, or if remapping
+	// failed
+	void *new = alloc(size);
+
+	if (new == NULL) {
+		return NULL;
+	}
+
+	memcpy(new, address, min(old, size));
+	free(address);
+
+	return new;
 }
 
 int allocator_expand(size_t pages) {
-	(void)pages;
-	return 0;
+	int cumulative_err = 0;
+
+	for (int i = 0; i < meta.classes; i++) {
+		cumulative_err += (slab_expand(&meta, i, pages) == 0);
+	}
+
+	return cumulative_err;
+}
+
+size_t allocator_shrink() {
+	return slab_shrink(&meta) + slab_shrink(&medium) + vmm_cache_flush() / PAGE_SIZE;
+}
+
+// Undo a partial init_allocator, the SLABs own nothing but the range and
+// the magazines of the small one
+// Return: -1
+static int init_allocator_unwind(void *range) {
+	if (meta.cpus != NULL) {
+		pmm_contig_free(meta.cpus, ALIGN(sizeof(struct ARC_SlabCpu) * ARC_MM_MAX_CPUS, PAGE_SIZE) / PAGE_SIZE);
+	}
+
+	memset(&meta, 0, sizeof(meta));
+	memset(&medium, 0, sizeof(medium));
+	vmm_free(range);
+
+	return -1;
 }
 
 int init_allocator(size_t pages) {
-	size_t range_length = (pages << 12) * 8;
-	void *range = (void *)vmm_alloc(range_length);
+	size_t range_length = (pages << 12) * SIZE_CLASSES;
+	size_t medium_length = (max(pages, MEDIUM_PAGES) << 12) * MEDIUM_CLASSES;
+	void *range = (void *)vmm_alloc(range_length + medium_length);
 
 	if (range == NULL) {
 		return -1;
 	}
 
-	// NOTE: Bit 0 is set here as the free function blindly pokes the SLAB allocator
-	//       to see if it can free the given address. If it can't the SLAB allocator, properly
-	//       reports an error. This is not desired here, as the allocation may be allocated using
-	//       the VMM instead. The free function resorts to reporting its own error in the event
-	//       it fails
-	return init_slab(&meta, range, range_length, 1) != range + range_length;
+	// Bit 2: most kernel allocations are small and short lived, keep them on
+	//        per-CPU magazines
+	if (init_slab(&meta, range, range_length, size_classes, SIZE_CLASSES, 1 << 2) != range + range_length) {
+		return init_allocator_unwind(range);
+	}
+
+	// No magazines for medium objects, each would hold tens of them per CPU
+	// and class, megabytes in total, the lists are locked once per object
+	// which is little next to the size of it
+	void *medium_range = range + range_length;
+
+	if (init_slab(&medium, medium_range, medium_length, medium_classes, MEDIUM_CLASSES, 0) != medium_range + medium_length) {
+		return init_allocator_unwind(range);
+	}
+
+	// Bursts should not fail while the PMM has pages, double each growth of a
+	// class so that a class which keeps running dry takes few regions
+	if (slab_set_growth(&medium, ARC_SLAB_GROW_GEOMETRIC, MEDIUM_PAGES, 0) != 0
+	    || slab_set_growth(&meta, ARC_SLAB_GROW_GEOMETRIC, pages, 0) != 0) {
+		return init_allocator_unwind(range);
+	}
+
+	// Last, as the page map cannot give back its root
+	if (init_pagemap(&large) != 0) {
+		return init_allocator_unwind(range);
+	}
+
+	return 0;
 }
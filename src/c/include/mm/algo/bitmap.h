@@ -0,0 +1,206 @@
+/**
+ * @file bitmap.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Bitmap backed region allocator, every object of a region is represented by
+ * a bit which is set while the object is free. Contiguous runs are found by
+ * scanning the bitmap a word at a time.
+*/
+#ifndef ARC_MM_ALGO_BITMAP_H
+#define ARC_MM_ALGO_BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/atomics.h>
+#include <mm/algo/range.h>
+
+struct ARC_BitmapMeta {
+	/// First object.
+	void *base;
+	/// Last object.
+	void *ceil;
+	/// Next joined bitmap.
+	struct ARC_BitmapMeta *next;
+	/// Index of the joined bitmaps, NULL if frees walk the chain.
+	struct ARC_RangeIndex *index;
+	/// Bit per object, set if the object is free.
+	uint64_t *bitmap;
+	/// Size of each object in bytes.
+	uint64_t object_size;
+	/// Number of objects in this meta.
+	uint64_t objects;
+	/// Number of free objects in this meta.
+	uint64_t free_objects;
+	/// Word of the bitmap from which single allocations start searching.
+	uint64_t hint;
+	/// Lock for everything.
+	ARC_GenericMutex mutex;
+};
+
+/**
+ * Allocate a single object in the given meta or any meta joined to it.
+ *
+ * @param struct ARC_BitmapMeta *meta - The bitmap from which to allocate one object.
+ * @return A void * to the base of the newly allocated object.
+ * */
+void *bitmap_alloc(struct ARC_BitmapMeta *meta);
+
+/**
+ * Allocate a batch of objects, not necessarily contiguous.
+ *
+ * Each bitmap of the chain is locked once, however many objects it gives.
+ *
+ * @param struct ARC_BitmapMeta *meta - The bitmap from which to allocate.
+ * @param uint64_t count - The number of objects wanted.
+ * @param void **objects - Array of at least count entries receiving the objects.
+ * @return the number of objects allocated, less than count if the chain ran out.
+ * */
+uint64_t bitmap_alloc_n(struct ARC_BitmapMeta *meta, uint64_t count, void **objects);
+
+/**
+ * Allocate a contiguous section of memory.
+ *
+ * The first run of at least \a objects free objects in the given meta, or any
+ * meta joined to it, is returned. The search is bounded by the size of the
+ * bitmaps, not by the order in which objects were freed.
+ *
+ * @param struct ARC_BitmapMeta *meta - The bitmap in which to allocate the section.
+ * @param uint64_t objects - Number of contiguous objects to allocate.
+ * @return The base address of the contiguous section.
+ * */
+void *bitmap_contig_alloc(struct ARC_BitmapMeta *meta, uint64_t objects);
+
+/**
+ * Allocate a contiguous section of memory starting at an aligned address.
+ *
+ * @param struct ARC_BitmapMeta *meta - The bitmap in which to allocate the section.
+ * @param uint64_t objects - Number of contiguous objects to allocate.
+ * @param uint64_t align - Alignment of the section's base address in bytes, a power of two (zero for none).
+ * @return The base address of the contiguous section.
+ * */
+void *bitmap_contig_alloc_aligned(struct ARC_BitmapMeta *meta, uint64_t objects, uint64_t align);
+
+/**
+ * Check whether the given address is an allocated object of the chain.
+ *
+ * Indexed chains are checked without taking any locks.
+ *
+ * @param struct ARC_BitmapMeta *meta - The bitmap (or one joined before the owner) to check.
+ * @param void *address - The address to check.
+ * @return non-zero if the address is the base of an allocated object.
+ * */
+int bitmap_is_allocated(struct ARC_BitmapMeta *meta, void *address);
+
+/**
+ * Free the object at the given address.
+ *
+ * @param struct ARC_BitmapMeta *meta - The bitmap (or one joined before the owner) in which to free the address.
+ * @param void *address - A pointer to the base of the object to be freed.
+ * @return \a address when successful.
+ * */
+void *bitmap_free(struct ARC_BitmapMeta *meta, void *address);
+
+/**
+ * Free a contiguous section of memory.
+ *
+ * @param struct ARC_BitmapMeta *meta - The bitmap (or one joined before the owner) in which to free the section.
+ * @param void *address - The base address of the contiguous section.
+ * @param uint64_t objects - The number of objects the section consists of.
+ * @return The base address if the free was successful.
+ * */
+void *bitmap_contig_free(struct ARC_BitmapMeta *meta, void *address, uint64_t objects);
+
+/**
+ * Free a batch of objects.
+ *
+ * Consecutive objects belonging to the same bitmap are freed under a single
+ * lock. Objects which are not allocated objects of the chain are skipped.
+ *
+ * @param struct ARC_BitmapMeta *meta - The bitmap (or one joined before the owners) in which to free the objects.
+ * @param uint64_t count - The number of objects to free.
+ * @param void **objects - The objects to free.
+ * @return the number of objects freed.
+ * */
+uint64_t bitmap_free_n(struct ARC_BitmapMeta *meta, uint64_t count, void **objects);
+
+/**
+ * Combine bitmap A and bitmap B.
+ *
+ * @return When a 0 is returned, linking of A and B was successfull.\n
+ * When a -1 is returned, the object size of A and B don't match.\n
+ * When a -2 is returned, either bitmap is NULL.\n
+ * */
+int link_bitmaps(struct ARC_BitmapMeta *A, struct ARC_BitmapMeta *B);
+
+/**
+ * Index the given bitmap and every bitmap joined to it.
+ *
+ * Frees locate the bitmap owning an address by a binary search of the index,
+ * taking only the owner's lock, instead of walking the chain. Bitmaps joined
+ * later with link_bitmaps are added to the index.
+ *
+ * @param struct ARC_BitmapMeta *meta - The first bitmap of the chain.
+ * @param struct ARC_RangeIndex *index - An initialized index to record the bitmaps in.
+ * @return zero upon success, -2 if some bitmaps did not fit into the index.
+ * */
+int bitmap_attach_index(struct ARC_BitmapMeta *meta, struct ARC_RangeIndex *index);
+
+/**
+ * Number of bytes of bitmap needed to describe the given region.
+ *
+ * @param uint64_t _base - The lowest address within the region.
+ * @param uint64_t _ceil - The highest address within the region + object_size.
+ * @param uint64_t _object_size - The size of each object in bytes.
+ * @return the size of the bitmap in bytes.
+ * */
+size_t bitmap_bookkeeping_size(uint64_t _base, uint64_t _ceil, uint64_t _object_size);
+
+/**
+ * Initialize a bitmap whose meta and bitmap live outside of the region.
+ *
+ * Every object starts out allocated, objects are made available by freeing them.
+ *
+ * @param struct ARC_BitmapMeta *meta - The meta to initialize.
+ * @param uint64_t *bitmap - Storage of at least bitmap_bookkeeping_size(_base, _ceil, _object_size) bytes.
+ * @param uint64_t _base - The lowest address within the region.
+ * @param uint64_t _ceil - The highest address within the region + object_size.
+ * @param uint64_t _object_size - The size of each object in bytes.
+ * @return zero upon success.
+ * */
+int init_static_bitmap(struct ARC_BitmapMeta *meta, uint64_t *bitmap, uint64_t _base, uint64_t _ceil, uint64_t _object_size);
+
+/**
+ * Initialize the given memory as a bitmap.
+ *
+ * The meta and the bitmap are placed at the base of the region, every object
+ * after them starts out free.
+ *
+ * @param uint64_t _base - The lowest address within the region.
+ * @param uint64_t _ceil - The highest address within the region + object_size.
+ * @param uint64_t _object_size - The size of each object in bytes.
+ * @return returns the pointer to the bitmap meta (_base == return value).
+ * */
+struct ARC_BitmapMeta *init_bitmap(uint64_t _base, uint64_t _ceil, uint64_t _object_size);
+
+#endif
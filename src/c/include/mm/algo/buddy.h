@@ -47,12 +47,83 @@ struct ARC_BuddyMeta {
 void *buddy_alloc(struct ARC_BuddyMeta *meta, size_t size);
 size_t buddy_free(struct ARC_BuddyMeta *meta, void *address);
 
+/**
+ * Allocate a block starting at an aligned address.
+ *
+ * A free block holding an aligned block of the needed order is split down
+ * to it, the halves split off are left free.
+ *
+ * @param struct ARC_BuddyMeta *meta - The allocator.
+ * @param size_t size - Number of bytes to allocate.
+ * @param size_t align - Alignment of the block in bytes, a power of two.
+ * @return the base of the block, NULL if no aligned block is free.
+ * */
+void *buddy_alloc_aligned(struct ARC_BuddyMeta *meta, size_t size, size_t align);
+
+/**
+ * Size of the allocated block at the given address.
+ *
+ * @param struct ARC_BuddyMeta *meta - The allocator.
+ * @param void *address - Base of the block.
+ * @return the size of the block in bytes, zero if no block is allocated there.
+ * */
+size_t buddy_size(struct ARC_BuddyMeta *meta, void *address);
+
+/**
+ * Grow an allocated block in place by absorbing its free buddies.
+ *
+ * Only possible if the block is the lower half of each larger block up to the
+ * new size, and all of the upper halves are free.
+ *
+ * @param struct ARC_BuddyMeta *meta - The allocator.
+ * @param void *address - Base of the block.
+ * @param size_t size - The size the block should hold.
+ * @return the new size of the block in bytes, zero if it could not grow.
+ * */
+size_t buddy_grow(struct ARC_BuddyMeta *meta, void *address, size_t size);
+
+/**
+ * Shrink an allocated block in place, freeing the halves no longer needed.
+ *
+ * @param struct ARC_BuddyMeta *meta - The allocator.
+ * @param void *address - Base of the block.
+ * @param size_t size - The size the block should hold.
+ * @return the new size of the block in bytes, zero if no block is allocated there.
+ * */
+size_t buddy_shrink(struct ARC_BuddyMeta *meta, void *address, size_t size);
+
+/**
+ * Size of the bookkeeping a buddy allocator requires.
+ *
+ * @param size_t size - Size of the allocatable region.
+ * @param size_t smallest_object - Size of the smallest allocatable object.
+ * @return the number of bytes init_static_buddy expects, zero on invalid parameters.
+ * */
+size_t buddy_bookkeeping_size(size_t size, size_t smallest_object);
+
+/**
+ * Create a buddy allocator within preallocated bookkeeping
+ *
+ * All state of the allocator lives in the given buffer, allocations and frees
+ * never allocate memory themselves.
+ *
+ * @param struct ARC_BuddyMeta *meta - Meta of the allocator.
+ * @param void *base - First allocatable address.
+ * @param size_t size - Size of the first allocatable region (rounded down to a multiple of smallest_object).
+ * @param size_t smallest_object - Size of the smallest allocatable object (ensure this is aligned to the nearest power of 2).
+ * @param void *bookkeeping - Buffer of at least buddy_bookkeeping_size(size, smallest_object) bytes.
+ * @return zero upon success.
+ * */
+int init_static_buddy(struct ARC_BuddyMeta *meta, void *base, size_t size, size_t smallest_object, void *bookkeeping);
+
 /**
  * Create a buddy allocator
  *
+ * The bookkeeping is allocated from the PMM, see init_static_buddy.
+ *
  * @param struct ARC_BuddyMeta *meta - Meta of the allocator.
  * @param void *base - First allocatable address.
- * @param size_t size - Size of the first allocatable region (ensure this is aligned to the nearest power of 2).
+ * @param size_t size - Size of the first allocatable region (rounded down to a multiple of smallest_object).
  * @param size_t smallest_object - Size of the smallest allocatable object (ensure this is aligned to the nearest power of 2).
  * @return zero upon success.
  *  */
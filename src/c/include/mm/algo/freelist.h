@@ -30,30 +30,49 @@
 
 #include <stdint.h>
 #include <lib/atomics.h>
+#include <mm/algo/range.h>
 
 struct ARC_FreelistNode {
 	struct ARC_FreelistNode *next __attribute__((aligned(8)));
 };
 
-// BUG: I foresee a bug here. If an allocation is directly after
-//      this header, then it is possible for this object to be overwritten
-//      and screwed with, intentionally or unintentionally
+#define ARC_FREELIST_META_ALIGN 64
+
+// The meta is either placed at the base of the region it manages (init_freelist)
+// or anywhere else suitably aligned (init_static_freelist). Fields are grouped
+// by who writes them so that allocations, lock traffic and walks of the chain
+// do not false-share
 struct ARC_FreelistMeta {
+	// Written by every allocation and free
 	/// Current free node.
-	struct ARC_FreelistNode *head __attribute__((aligned(8)));
+	struct ARC_FreelistNode *head __attribute__((aligned(ARC_FREELIST_META_ALIGN)));
+	/// Incremented by every lock-free pop, paired with head so that a
+	/// compare and exchange of both cannot suffer from ABA.
+	uint64_t tag;
+	/// First object which has never been handed out, objects from here to
+	/// ceil are free but not linked into the list.
+	struct ARC_FreelistNode *bump;
+	/// Number of free objects in this meta.
+	uint64_t free_objects;
+
+	/// Lock for everything, unused by lock-free lists.
+	ARC_GenericMutex mutex __attribute__((aligned(ARC_FREELIST_META_ALIGN)));
+
+	// Read-mostly
 	/// First node.
-	struct ARC_FreelistNode *base __attribute__((aligned(8)));
+	struct ARC_FreelistNode *base __attribute__((aligned(ARC_FREELIST_META_ALIGN)));
 	/// Last node.
-	struct ARC_FreelistNode *ceil __attribute__((aligned(8)));
+	struct ARC_FreelistNode *ceil;
 	/// Next joined list.
-	struct ARC_FreelistMeta *next __attribute__((aligned(8)));
+	struct ARC_FreelistMeta *next;
+	/// Index of the joined lists, NULL if frees walk the chain.
+	struct ARC_RangeIndex *index;
 	/// Size of each node in bytes.
-	uint64_t object_size __attribute__((aligned(8)));
-	/// Number of free objects in this meta.
-	uint64_t free_objects __attribute__((aligned(8)));
-	/// Lock for everything.
-	ARC_GenericMutex mutex;
-}__attribute__((packed));
+	uint64_t object_size;
+	/// Bit | Description
+	/// 0   | 1: Lock-free, head is updated with compare and exchange instead of under the mutex
+	uint64_t attributes;
+};
 
 /**
  * Allocate a single object in the given meta.
@@ -63,6 +82,18 @@ struct ARC_FreelistMeta {
  * */
 void *freelist_alloc(struct ARC_FreelistMeta *meta);
 
+/**
+ * Allocate a batch of objects, not necessarily contiguous.
+ *
+ * Each list of the chain is locked once, however many objects it gives.
+ *
+ * @param struct ARC_FreelistMeta *meta - The list from which to allocate.
+ * @param uint64_t count - The number of objects wanted.
+ * @param void **objects - Array of at least count entries receiving the objects.
+ * @return the number of objects allocated, less than count if the chain ran out.
+ * */
+uint64_t freelist_alloc_n(struct ARC_FreelistMeta *meta, uint64_t count, void **objects);
+
 /**
  * Allocate a contiguous section of memory.
  *
@@ -81,6 +112,19 @@ void *freelist_contig_alloc(struct ARC_FreelistMeta *meta, uint64_t objects);
  * */
 void *freelist_free(struct ARC_FreelistMeta *meta, void *address);
 
+/**
+ * Free a batch of objects.
+ *
+ * Consecutive objects belonging to the same list of the chain are linked
+ * together and spliced into it under a single lock.
+ *
+ * @param struct ARC_FreelistMeta *meta - The freelist in which to free the objects.
+ * @param uint64_t count - The number of objects to free.
+ * @param void **objects - The objects to free.
+ * @return the number of objects freed.
+ * */
+uint64_t freelist_free_n(struct ARC_FreelistMeta *meta, uint64_t count, void **objects);
+
 /**
  * Free a contiguous section of memory.
  *
@@ -99,13 +143,74 @@ void *freelist_contig_free(struct ARC_FreelistMeta *meta, void *address, uint64_
  * */
 int link_freelists(struct ARC_FreelistMeta *A, struct ARC_FreelistMeta *B);
 
+/**
+ * Remove list B from the chain of list A.
+ *
+ * B is only removed if none of its objects are allocated, after which nothing
+ * in the chain refers to it and its memory may be released. Lock-free chains
+ * cannot be split, as a concurrent allocation may still be reading B.
+ *
+ * @return When a 0 is returned, B was removed from the chain.\n
+ * When a -1 is returned, B is not joined to A.\n
+ * When a -2 is returned, either list is NULL or A is B.\n
+ * When a -3 is returned, B has allocated objects or the chain is lock-free.\n
+ * */
+int unlink_freelist(struct ARC_FreelistMeta *A, struct ARC_FreelistMeta *B);
+
+/**
+ * Set the attributes of the given list and every list joined to it.
+ *
+ * Must be done before the lists are used, lists joined later with
+ * link_freelists inherit the attributes. See the meta structure for bit
+ * definitions.
+ *
+ * With bit 0 set the lists become lock-free (Treiber) stacks, the head and its
+ * tag are swapped with a double width compare and exchange and free_objects is
+ * maintained atomically.
+ *
+ * @param struct ARC_FreelistMeta *meta - The first list of the chain.
+ * @param uint64_t attributes - The attributes to set.
+ * @return zero upon success.
+ * */
+int freelist_set_attributes(struct ARC_FreelistMeta *meta, uint64_t attributes);
+
+/**
+ * Index the given list and every list joined to it.
+ *
+ * Frees locate the list owning an address by a binary search of the index,
+ * taking only the owner's lock, instead of walking the chain. Lists joined
+ * later with link_freelists are added to the index.
+ *
+ * @param struct ARC_FreelistMeta *meta - The first list of the chain.
+ * @param struct ARC_RangeIndex *index - An initialized index to record the lists in.
+ * @return zero upon success, -2 if some lists did not fit into the index.
+ * */
+int freelist_attach_index(struct ARC_FreelistMeta *meta, struct ARC_RangeIndex *index);
+
+/**
+ * Initialize a freelist whose meta lives outside of the region.
+ *
+ * Every object of the region is allocatable, none are given up for the meta.
+ *
+ * @param struct ARC_FreelistMeta *meta - The meta to initialize, aligned to ARC_FREELIST_META_ALIGN.
+ * @param uint64_t _base - The lowest address within the list.
+ * @param uint64_t _ceil - The highest address within the list + object_size.
+ * @param uint64_t _object_size - The size of each object in bytes.
+ * @return zero upon success.
+ * */
+int init_static_freelist(struct ARC_FreelistMeta *meta, uint64_t _base, uint64_t _ceil, uint64_t _object_size);
+
 /**
  * Initialize the given memory as a freelist.
  *
+ * Initialization takes constant time, objects are handed out from the
+ * untouched part of the region before the list of freed objects is built up.
+ *
  * @param uint64_t _base - The lowest address within the list.
  * @param uint64_t _ceil - The highest address within the list + object_size.
  * @param uint64_t _object_size - The size of each object in bytes.
- * @return returns the pointer to the freelist meta (_base == return value).
+ * @return returns the pointer to the freelist meta (_base == return value, _base
+ * should be aligned to ARC_FREELIST_META_ALIGN).
  * */
 struct ARC_FreelistMeta *init_freelist(uint64_t _base, uint64_t _ceil, uint64_t _object_size);
 
@@ -0,0 +1,79 @@
+/**
+ * @file pagemap.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Radix table mapping every page of the address space to a value, used to find
+ * the owner of an address in constant time.
+*/
+#ifndef ARC_MM_ALGO_PAGEMAP_H
+#define ARC_MM_ALGO_PAGEMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/atomics.h>
+
+/// Bits of the page number resolved by each level, one level fills a page.
+#define ARC_PAGEMAP_BITS 9
+/// Number of levels, enough to cover 48-bit addresses.
+#define ARC_PAGEMAP_LEVELS 4
+
+struct ARC_PageMap {
+	/// Top level of the table.
+	void **root;
+	/// Number of pages taken by the table.
+	size_t nodes;
+	/// Lock for modifications, lookups do not take it.
+	ARC_GenericMutex mutex;
+};
+
+/**
+ * Get the value of the page containing the given address.
+ *
+ * Lookups take no locks, nodes of the table are never freed.
+ *
+ * @param struct ARC_PageMap *map - The map to search.
+ * @param void *address - The address to look up.
+ * @return the value of the page, NULL if none was set.
+ * */
+void *pagemap_get(struct ARC_PageMap *map, void *address);
+
+/**
+ * Set the value of a run of pages.
+ *
+ * @param struct ARC_PageMap *map - The map to modify.
+ * @param void *address - Address within the first page of the run.
+ * @param size_t pages - Number of pages in the run.
+ * @param void *value - The value to give each page, NULL to clear them.
+ * @return zero upon success, -1 if the table could not be grown.
+ * */
+int pagemap_set(struct ARC_PageMap *map, void *address, size_t pages, void *value);
+
+/**
+ * Initialize an empty map.
+ *
+ * @param struct ARC_PageMap *map - The map to initialize.
+ * @return zero upon success.
+ * */
+int init_pagemap(struct ARC_PageMap *map);
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * @file range.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Sorted index of non-overlapping address ranges, used to find the meta owning
+ * an address without walking a chain of metas.
+*/
+#ifndef ARC_MM_ALGO_RANGE_H
+#define ARC_MM_ALGO_RANGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/atomics.h>
+
+struct ARC_RangeEntry {
+	/// Lowest address in the range.
+	uint64_t base;
+	/// Highest address in the range.
+	uint64_t ceil;
+	/// Owner of the range.
+	void *owner;
+};
+
+struct ARC_RangeIndex {
+	/// Entries sorted by base.
+	struct ARC_RangeEntry *entries;
+	/// Number of used entries.
+	size_t count;
+	/// Number of available entries.
+	size_t capacity;
+	/// Odd while the entries are being modified.
+	uint64_t sequence;
+	/// Lock for modifications, lookups do not take it.
+	ARC_GenericMutex mutex;
+};
+
+/**
+ * Find the owner of the range containing the given address.
+ *
+ * Lookups take no locks, they retry if they overlap with a modification.
+ *
+ * @param struct ARC_RangeIndex *index - The index to search.
+ * @param void *address - The address to look up.
+ * @return the owner of the range, NULL if no range contains the address.
+ * */
+void *range_index_find(struct ARC_RangeIndex *index, void *address);
+
+/**
+ * Insert a range.
+ *
+ * @param struct ARC_RangeIndex *index - The index to insert into.
+ * @param void *base - Lowest address in the range.
+ * @param void *ceil - Highest address in the range.
+ * @param void *owner - Value returned by lookups within the range.
+ * @return zero upon success, -1 if the index is full, -2 if the range overlaps another.
+ * */
+int range_index_insert(struct ARC_RangeIndex *index, void *base, void *ceil, void *owner);
+
+/**
+ * Remove every range belonging to the given owner.
+ *
+ * @param struct ARC_RangeIndex *index - The index to remove from.
+ * @param void *owner - The owner whose ranges to remove.
+ * @return the number of removed ranges.
+ * */
+int range_index_remove(struct ARC_RangeIndex *index, void *owner);
+
+/**
+ * Initialize an empty index.
+ *
+ * @param struct ARC_RangeIndex *index - The index to initialize.
+ * @param struct ARC_RangeEntry *storage - Storage for the entries.
+ * @param size_t capacity - Number of entries the storage can hold.
+ * @return zero upon success.
+ * */
+int init_range_index(struct ARC_RangeIndex *index, struct ARC_RangeEntry *storage, size_t capacity);
+
+#endif
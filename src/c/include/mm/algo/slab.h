@@ -28,16 +28,173 @@
 #define ARC_MM_ALGO_SLAB_H
 
 #include <stddef.h>
+#include <lib/atomics.h>
 #include <mm/algo/freelist.h>
+#include <mm/algo/pagemap.h>
+#include <mm/percpu.h>
+
+/// Maximum number of size classes, must stay below ARC_FREELIST_META_ALIGN.
+#define ARC_SLAB_MAX_CLASSES 32
+/// Number of entries in the size to class lookup table.
+#define ARC_SLAB_LOOKUP_ENTRIES 256
+
+/// Number of objects a magazine holds.
+#define ARC_SLAB_MAGAZINE_ROUNDS 30
+
+/// A stack of objects of one size class, moved whole between CPUs and the depot.
+struct ARC_SlabMagazine {
+	struct ARC_SlabMagazine *next;
+	size_t rounds;
+	void *objects[ARC_SLAB_MAGAZINE_ROUNDS];
+};
+
+/// The pair of magazines one CPU holds for one size class.
+struct ARC_SlabMagazines {
+	struct ARC_SlabMagazine *loaded;
+	struct ARC_SlabMagazine *previous;
+};
+
+/// Magazines owned by one CPU, one pair per size class.
+struct ARC_SlabCpu {
+	ARC_GenericMutex mutex;
+	struct ARC_SlabMagazines classes[ARC_SLAB_MAX_CLASSES];
+} __attribute__((aligned(ARC_MM_CACHE_LINE)));
+
+/// Magazines of one size class not held by any CPU.
+struct ARC_SlabDepot {
+	ARC_GenericMutex mutex;
+	struct ARC_SlabMagazine *full;
+	struct ARC_SlabMagazine *empty;
+	size_t full_count;
+	size_t empty_count;
+	/// List new magazines are allocated from, NULL to carve them out of
+	/// pages from the PMM.
+	struct ARC_FreelistMeta *source;
+} __attribute__((aligned(ARC_MM_CACHE_LINE)));
+
+/// Never grow a class on its own, only through slab_expand.
+#define ARC_SLAB_GROW_NONE 0
+/// Grow an exhausted class by the same number of pages every time.
+#define ARC_SLAB_GROW_FIXED 1
+/// Grow an exhausted class by twice the pages of its previous growth.
+#define ARC_SLAB_GROW_GEOMETRIC 2
+
+struct ARC_SlabGrowth {
+	/// One of ARC_SLAB_GROW_*.
+	int policy;
+	/// Pages added by the first growth of a class.
+	size_t pages;
+	/// Most pages a class may grow by in total, zero for no limit.
+	size_t max_pages;
+	/// Pages each class has grown by so far.
+	size_t grown[ARC_SLAB_MAX_CLASSES];
+	/// Pages added by the previous growth of each class.
+	size_t last[ARC_SLAB_MAX_CLASSES];
+	/// Bit per class, set once the class has been refused growth by max_pages.
+	uint32_t capped;
+	/// Serializes growths so that CPUs running dry together grow a class once.
+	ARC_GenericMutex mutex;
+};
 
 struct ARC_SlabMeta {
 	struct ARC_FreelistMeta *physical_mem;
-	struct ARC_FreelistMeta *lists[8];
-	size_t list_sizes[8];
+	struct ARC_FreelistMeta *lists[ARC_SLAB_MAX_CLASSES];
+	/// Metas of the lists created by init_slab, lists added by slab_expand
+	/// keep theirs at the base of their own pages.
+	struct ARC_FreelistMeta list_metas[ARC_SLAB_MAX_CLASSES];
+	/// Object size of each list, ascending.
+	size_t list_sizes[ARC_SLAB_MAX_CLASSES];
+	/// Number of lists in use.
+	int classes;
+	/// Index of the smallest list fitting (i << lookup_shift) bytes.
+	uint8_t lookup[ARC_SLAB_LOOKUP_ENTRIES + 1];
+	/// Granularity of the lookup table.
+	int lookup_shift;
+	/// Maps each page of every list to the freelist meta of its region, with
+	/// the index of the list in the low bits of the pointer.
+	struct ARC_PageMap pages;
+	/// ARC_MM_MAX_CPUS entries, NULL if the magazine layer is disabled.
+	struct ARC_SlabCpu *cpus;
+	struct ARC_SlabDepot depots[ARC_SLAB_MAX_CLASSES];
+	/// How exhausted classes are grown by slab_alloc.
+	struct ARC_SlabGrowth growth;
 	void *range;
 	size_t range_length;
 	uint32_t attributes; // Bit | Description
 			     // 0   | 1: Disable error message on frees, (0): Enable error message on frees
+			     // 1   | 1: Lock-free lists, (0): Lists are protected by their mutexes
+			     // 2   | 1: Per-CPU magazines in front of the lists, (0): Go straight to the lists
+};
+
+/// Allocation flag, the object is zeroed before it is handed out.
+#define ARC_SLAB_ZERO (1 << 0)
+
+/// Counters of a cache, updated atomically.
+struct ARC_SlabCacheStats {
+	/// Successful allocations.
+	uint64_t allocs;
+	/// Frees.
+	uint64_t frees;
+	/// Allocations which found no memory.
+	uint64_t failures;
+	/// Objects currently allocated.
+	uint64_t active;
+	/// Most objects ever allocated at once.
+	uint64_t peak;
+};
+
+/// Most regions a cache may grow to, including the one it starts with.
+#define ARC_SLAB_CACHE_REGIONS 16
+
+/// Magazines owned by one CPU for a cache.
+struct ARC_SlabCacheCpu {
+	ARC_GenericMutex mutex;
+	struct ARC_SlabMagazines magazines;
+} __attribute__((aligned(ARC_MM_CACHE_LINE)));
+
+/// A cache of objects of one type, a SLAB with a single class of its own.
+struct ARC_SlabCache {
+	/// Name of the cache, for debugging.
+	const char *name;
+	/// Size requested by the creator of the cache.
+	size_t object_size;
+	/// Distance between objects, object_size (plus the link when objects
+	/// are constructed) rounded up to the alignment.
+	size_t stride;
+	/// Offset of the freelist link in each object, past the object itself
+	/// when the cache constructs objects so free ones keep their state,
+	/// zero otherwise.
+	size_t link;
+	/// Alignment of every object.
+	size_t align;
+	/// Called on each object when its region is allocated, may be NULL.
+	void (*ctor)(void *object);
+	/// Called on each object when its region is released, may be NULL.
+	void (*dtor)(void *object);
+	/// ARC_SLAB_* allocation flags applied to every object, before ctor.
+	uint32_t flags;
+	/// Attributes of the cache, see the SLAB meta structure.
+	uint32_t attributes;
+	struct ARC_SlabCacheStats stats;
+	/// Meta of the region the cache starts with, regions added by growth
+	/// keep theirs at the end of their own pages.
+	struct ARC_FreelistMeta list;
+	/// Maps each region to its meta, which also tells objects of the cache
+	/// from foreign ones.
+	struct ARC_RangeIndex index;
+	struct ARC_RangeEntry regions[ARC_SLAB_CACHE_REGIONS];
+	/// ARC_MM_MAX_CPUS entries, NULL if the magazine layer is disabled.
+	struct ARC_SlabCacheCpu *cpus;
+	struct ARC_SlabDepot depot;
+	/// Pages of the region the cache starts with, the first growth adds as
+	/// many and each one after twice the previous.
+	size_t pages;
+	/// Pages added by growth so far.
+	size_t grown;
+	/// Pages added by the previous growth.
+	size_t last;
+	/// Serializes growths and shrinks.
+	ARC_GenericMutex mutex;
 };
 
 /**
@@ -48,6 +205,18 @@ struct ARC_SlabMeta {
  * */
 void *slab_alloc(struct ARC_SlabMeta *meta, size_t size);
 
+/**
+ * Allocate \a size bytes in the kernel heap.
+ *
+ * Objects are not cleared when they are freed, pass ARC_SLAB_ZERO for an
+ * allocation which must start out zeroed.
+ *
+ * @param size_t size - The number of bytes to allocate.
+ * @param uint32_t flags - ARC_SLAB_* allocation flags.
+ * @return The base address of the allocation.
+ * */
+void *slab_alloc_flags(struct ARC_SlabMeta *meta, size_t size, uint32_t flags);
+
 /**
  * Free the allocation at \a address.
  *
@@ -56,27 +225,191 @@ void *slab_alloc(struct ARC_SlabMeta *meta, size_t size);
  * */
 void *slab_free(struct ARC_SlabMeta *meta, void *address);
 
+/**
+ * Free the allocation at \a address, which was allocated with \a size bytes.
+ *
+ * The size is checked against the class the page map records for the
+ * object, an object freed with the size of another class is freed as
+ * slab_free would.
+ *
+ * @param void *address - The allocation to free from the kernel heap.
+ * @param size_t size - Any size from the one allocated up to slab_size of the object.
+ * @return The given address if successful.
+ * */
+void *slab_free_sized(struct ARC_SlabMeta *meta, void *address, size_t size);
+
+/**
+ * Allocate \a size bytes at an address aligned to \a align.
+ *
+ * Served from the smallest class holding \a size whose object size is a
+ * multiple of \a align, no memory is trimmed off.
+ *
+ * @param size_t size - The number of bytes to allocate.
+ * @param size_t align - The alignment in bytes, a power of two no greater than PAGE_SIZE.
+ * @return The base address of the allocation, NULL if no class fits.
+ * */
+void *slab_alloc_aligned(struct ARC_SlabMeta *meta, size_t size, size_t align);
+
+/**
+ * Size of the object at \a address.
+ *
+ * @param void *address - An object allocated from the SLAB.
+ * @return the size of the object's class in bytes, zero if the address is not in the SLAB.
+ * */
+size_t slab_size(struct ARC_SlabMeta *meta, void *address);
+
+/**
+ * Size of the objects of the class serving \a size bytes.
+ *
+ * @param size_t size - The number of bytes requested.
+ * @return the object size of the class, zero if no class holds the size.
+ * */
+size_t slab_class_size(struct ARC_SlabMeta *meta, size_t size);
+
+/**
+ * Allocate a batch of objects of \a size bytes.
+ *
+ * The size class is looked up once, and the magazines and lists are each
+ * locked once for the whole batch.
+ *
+ * @param size_t size - The number of bytes of each object.
+ * @param size_t count - The number of objects wanted.
+ * @param void **objects - Array of at least count entries receiving the objects.
+ * @return the number of objects allocated, less than count if memory ran out.
+ * */
+size_t slab_alloc_bulk(struct ARC_SlabMeta *meta, size_t size, size_t count, void **objects);
+
+/**
+ * Free a batch of objects.
+ *
+ * Runs of objects from the same region are handed to the magazines, or
+ * spliced into their list, under a single lock.
+ *
+ * @param size_t count - The number of objects to free.
+ * @param void **objects - The objects to free.
+ * @return the number of objects freed.
+ * */
+size_t slab_free_bulk(struct ARC_SlabMeta *meta, size_t count, void **objects);
+
 /**
  * Expand a given SLAB's list
  *
- * This will expand a certain list (0-7) by the given number
- * of pages.
+ * This will expand a certain list (0 to classes - 1) by the given
+ * number of pages.
  *
  * @param struct ARC_SlabMeta *slab - The SLAB to expand.
- * @param int list - The freelist within the SLAB (0-7).
+ * @param int list - The freelist within the SLAB (0 to classes - 1).
  * @param int pages - The number of pages to expand the list by.
  * @return zero upon success.
  * */
 int slab_expand(struct ARC_SlabMeta *slab, int list, size_t pages);
+
+/**
+ * Set how slab_alloc grows a class which has run out of objects.
+ *
+ * Growth takes pages from the PMM. A class which has reached \a max_pages is
+ * grown by whatever is left under the limit, then no more.
+ *
+ * @param struct ARC_SlabMeta *slab - The SLAB to configure.
+ * @param int policy - One of ARC_SLAB_GROW_*.
+ * @param size_t pages - Pages added by the first growth of a class.
+ * @param size_t max_pages - Most pages a class may grow by in total, zero for no limit.
+ * @return zero upon success.
+ * */
+int slab_set_growth(struct ARC_SlabMeta *slab, int policy, size_t pages, size_t max_pages);
+
+/**
+ * Return regions of the SLAB which have no allocated objects to the PMM.
+ *
+ * Objects held in the full magazines of the depots are first returned to
+ * their lists. The magazines loaded on each CPU are left alone, so that the
+ * CPUs do not have to rebuild them through the lists afterwards, a region
+ * holding any of their objects is kept. Only regions added by slab_expand or
+ * growth are released, the lists set up by init_slab are kept. Lock-free
+ * lists are never shrunk.
+ *
+ * May be called periodically or when memory runs low.
+ *
+ * @param struct ARC_SlabMeta *slab - The SLAB to shrink.
+ * @return the number of pages returned to the PMM.
+ * */
+size_t slab_shrink(struct ARC_SlabMeta *slab);
+
 /**
  * Initialize the kernel SLAB allocator.
  *
- * @param struct ARC_FreelistMeta *memory - The freelist in which to initialize the allocator's lists.
+ * The range is split evenly between the size classes, each class's share
+ * must be a whole number of pages.
+ *
+ * @param struct ARC_SlabMeta *meta - The SLAB to initialize.
  * @param void *range - The base address of the contiguous allocation where the SLAB should be initialized.
  * @param size_t range_size - Size of the range in bytes.
+ * @param const size_t *sizes - Ascending object sizes of the classes, multiples of 8, NULL for the powers of two from 16 to 2048.
+ * @param int classes - Number of entries in sizes (at most ARC_SLAB_MAX_CLASSES).
  * @param uint32_t attributes - Attributes the allocator should work with, see meta structure for bit definitions.
- * @return Error code (0: success).
+ * @return the address after the range upon success, NULL upon failure.
+ * */
+void *init_slab(struct ARC_SlabMeta *meta, void *range, size_t range_size, const size_t *sizes, int classes, uint32_t attributes);
+
+/**
+ * Allocate an object from a cache.
+ *
+ * @param struct ARC_SlabCache *cache - The cache to allocate from.
+ * @return the object, in the state it was freed in or freshly constructed, NULL upon failure.
+ * */
+void *slab_cache_alloc(struct ARC_SlabCache *cache);
+
+/**
+ * Give an object back to its cache.
+ *
+ * @param struct ARC_SlabCache *cache - The cache the object was allocated from.
+ * @param void *object - The object to free.
+ * @return the given object if successful.
+ * */
+void *slab_cache_free(struct ARC_SlabCache *cache, void *object);
+
+/**
+ * Return the regions of a cache which have no allocated objects to the PMM.
+ *
+ * The destructor runs on every object of a region before it is released.
+ *
+ * @param struct ARC_SlabCache *cache - The cache to shrink.
+ * @return the number of pages returned to the PMM.
+ * */
+size_t slab_cache_shrink(struct ARC_SlabCache *cache);
+
+/**
+ * Destroy a cache, returning all of its pages to the PMM.
+ *
+ * The destructor runs on every object of the cache. The cache must not be
+ * used concurrently and may be initialized again afterwards.
+ *
+ * @param struct ARC_SlabCache *cache - The cache to destroy.
+ * @return zero upon success, -1 if objects are still allocated from it.
+ * */
+int slab_cache_destroy(struct ARC_SlabCache *cache);
+
+/**
+ * Initialize a cache of objects of a single size.
+ *
+ * The cache starts with \a pages pages from the PMM and grows geometrically
+ * from there when it runs dry, up to ARC_SLAB_CACHE_REGIONS regions.
+ *
+ * Objects are constructed once, when the region holding them is allocated,
+ * and destructed when it is released. A freed object must be left in its
+ * constructed state, it is handed out again as is.
+ *
+ * @param struct ARC_SlabCache *cache - The cache to initialize.
+ * @param const char *name - Name of the cache, kept by reference.
+ * @param size_t object_size - Size of each object in bytes.
+ * @param size_t align - Alignment of each object, a power of two no greater than PAGE_SIZE, zero for 8 bytes.
+ * @param void (*ctor)(void *) - Called on each object when its region is allocated, may be NULL.
+ * @param void (*dtor)(void *) - Called on each object when its region is released, may be NULL.
+ * @param uint32_t flags - ARC_SLAB_* allocation flags, ARC_SLAB_ZERO clears objects on every allocation, or only before construction if there is a constructor.
+ * @param size_t pages - Number of pages to start with.
+ * @param uint32_t attributes - Attributes of the cache, see the SLAB meta structure.
+ * @return zero upon success.
  * */
-void *init_slab(struct ARC_SlabMeta *meta, void *range, size_t range_size, uint32_t attributes);
+int init_slab_cache(struct ARC_SlabCache *cache, const char *name, size_t object_size, size_t align, void (*ctor)(void *), void (*dtor)(void *), uint32_t flags, size_t pages, uint32_t attributes);
 
 #endif
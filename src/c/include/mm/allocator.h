@@ -30,11 +30,33 @@
 #include <stddef.h>
 
 void *alloc(size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
 void *calloc(size_t size, size_t count);
 void *free(void *address);
 void *realloc(void *address, size_t size);
 
+/**
+ * Free an allocation whose size is known to the caller.
+ *
+ * The size picks the allocator and SLAB class directly, without looking up
+ * the address. Not for allocations made by aligned_alloc.
+ *
+ * @param void *address - The allocation to free.
+ * @param size_t size - The size last passed to alloc, calloc (size * count) or realloc for it, or alloc_usable_size of it.
+ * @return the given address if successful.
+ * */
+void *free_sized(void *address, size_t size);
+
+/**
+ * Number of bytes usable at an allocation.
+ *
+ * @param void *address - The allocation.
+ * @return the usable size in bytes, at least the size requested, zero if the address is not allocated.
+ * */
+size_t alloc_usable_size(void *address);
+
 int allocator_expand(size_t pages);
+size_t allocator_shrink();
 
 int init_allocator(size_t pages);
 
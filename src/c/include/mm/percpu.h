@@ -0,0 +1,47 @@
+/**
+ * @file percpu.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan - Operating System Kernel
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan.
+ *
+ * Arctan is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Helpers for the per-CPU structures of the memory managers.
+ *
+ * Per-CPU structures are still protected by their own lock, so a thread which
+ * migrates between reading its CPU number and using the structure, or CPUs
+ * beyond ARC_MM_MAX_CPUS sharing a slot, remain correct. The lock is simply
+ * uncontended in the common case.
+*/
+#ifndef ARC_MM_PERCPU_H
+#define ARC_MM_PERCPU_H
+
+#include <arch/smp.h>
+
+#ifndef ARC_MM_MAX_CPUS
+#define ARC_MM_MAX_CPUS 64
+#endif
+
+#define ARC_MM_CACHE_LINE 64
+
+/// Index of the per-CPU slot of the calling processor.
+#define ARC_MM_CPU_SLOT() (smp_get_processor_id() % ARC_MM_MAX_CPUS)
+
+#endif
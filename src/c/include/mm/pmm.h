@@ -35,6 +35,45 @@ void *pmm_contig_alloc(size_t objects);
 void *pmm_free(void *address);
 void *pmm_contig_free(void *address, size_t objects);
 
+/**
+ * Allocate physically contiguous pages starting at an aligned address.
+ *
+ * @param size_t objects - Number of pages to allocate.
+ * @param size_t align - Alignment of the first page in bytes, a power of two (zero for a page).
+ * @return the HHDM address of the first page.
+ * */
+void *pmm_contig_alloc_aligned(size_t objects, size_t align);
+
+/**
+ * Allocate physically contiguous pages only if a run is free already.
+ *
+ * Unlike pmm_contig_alloc_aligned, the per-CPU caches are not drained to
+ * complete a run, for callers which can fall back to something else.
+ *
+ * @param size_t objects - Number of pages to allocate.
+ * @param size_t align - Alignment of the first page in bytes, a power of two (zero for a page).
+ * @return the HHDM address of the first page, NULL if there is no such run.
+ * */
+void *pmm_try_contig_alloc_aligned(size_t objects, size_t align);
+
+/**
+ * Set the watermarks of the per-CPU page caches.
+ *
+ * pmm_alloc and pmm_free are served from a cache local to the calling CPU.
+ * An empty cache is refilled with \a low pages from the global lists, a cache
+ * reaching \a high pages is drained back down to \a low pages.
+ *
+ * @param size_t low - Number of pages to refill an empty cache with.
+ * @param size_t high - Number of pages at which a cache is drained.
+ * @return zero upon success.
+ * */
+int pmm_set_cache_watermarks(size_t low, size_t high);
+
+/**
+ * Return all pages held by the per-CPU caches to the global lists.
+ * */
+void pmm_drain_caches();
+
 void *pmm_low_alloc();
 void *pmm_low_contig_alloc(size_t objects);
 void *pmm_low_free(void *address);
@@ -30,10 +30,123 @@
 #include <global.h>
 #include <stddef.h>
 
+/**
+ * Allocate a block of virtual address space and map the pages holding size bytes.
+ *
+ * The block is rounded up to a power of two, the pages past size are left
+ * unmapped until the allocation grows into them.
+ *
+ * @param size_t size - Number of bytes to allocate.
+ * @return the base of the allocation, NULL upon failure.
+ * */
 void *vmm_alloc(size_t size);
+
+/**
+ * Free a block from vmm_alloc or vmm_alloc_aligned.
+ *
+ * Blocks of up to 1 MiB are kept mapped in the cache of freed blocks.
+ *
+ * @param void *address - Base of the block.
+ * @return the given address, NULL if it is not the base of an allocated block,
+ * is already free or was allocated with vmm_alloc_nopage.
+ * */
 void *vmm_free(void *address);
 
+/**
+ * Allocate and map a block starting at an aligned virtual address.
+ *
+ * As with vmm_alloc, only the pages holding size bytes are mapped, the rest
+ * of the block is mapped when vmm_grow or vmm_remap grows into it.
+ *
+ * @param size_t size - Number of bytes to allocate.
+ * @param size_t align - Alignment of the block in bytes, a power of two.
+ * @return the base of the allocation.
+ * */
+void *vmm_alloc_aligned(size_t size, size_t align);
+
+/**
+ * Whether an address lies within the range managed by the VMM.
+ *
+ * @param void *address - The address to check.
+ * @return non-zero if the VMM's range holds the address.
+ * */
+int vmm_contains(void *address);
+
+/**
+ * Number of mapped bytes of the allocation at the given address.
+ *
+ * @param void *address - Base of an allocation made by vmm_alloc.
+ * @return the size in bytes, zero if nothing is allocated there.
+ * */
+size_t vmm_size(void *address);
+
+/**
+ * Grow an allocation in place, mapping the pages added to it.
+ *
+ * @param void *address - Base of an allocation made by vmm_alloc.
+ * @param size_t size - The size the allocation should hold.
+ * @return address if the allocation now holds size bytes, NULL if it cannot grow in place.
+ * */
+void *vmm_grow(void *address, size_t size);
+
+/**
+ * Resize an allocation to hold more bytes without copying it.
+ *
+ * If the allocation cannot grow in place, a larger range is allocated and
+ * the pages of the allocation are moved into it by editing the page tables,
+ * then the rest of the range is mapped.
+ *
+ * @param void *address - Base of an allocation made by vmm_alloc.
+ * @param size_t size - The size the allocation should hold.
+ * @return the base of the allocation, which may have moved, NULL upon failure (the allocation is left as it was).
+ * */
+void *vmm_remap(void *address, size_t size);
+
+/**
+ * Shrink an allocation in place, unmapping the pages removed from it.
+ *
+ * @param void *address - Base of an allocation made by vmm_alloc.
+ * @param size_t size - The size the allocation should still hold.
+ * @return address upon success.
+ * */
+void *vmm_shrink(void *address, size_t size);
+
+/**
+ * Release every block kept mapped by the cache of freed blocks.
+ *
+ * vmm_free keeps freed blocks of up to 1 MiB mapped, and vmm_alloc hands the
+ * most recently freed block of the needed size back out. The least recently
+ * freed blocks are released once the cache exceeds its budget.
+ *
+ * @return the number of bytes unmapped.
+ * */
+size_t vmm_cache_flush();
+
+/**
+ * Set the most bytes the cache of freed blocks may keep mapped.
+ *
+ * @param size_t bytes - The budget, zero to disable the cache.
+ * @return the number of bytes unmapped to fit the new budget.
+ * */
+size_t vmm_set_cache_budget(size_t bytes);
+
+/**
+ * Allocate a block of virtual address space without mapping any pages.
+ *
+ * The block must be released with vmm_free_nopage, vmm_free refuses it.
+ *
+ * @param size_t size - Number of bytes to reserve.
+ * @return the base of the block, NULL upon failure.
+ * */
 void *vmm_alloc_nopage(size_t size);
+
+/**
+ * Release a block from vmm_alloc_nopage.
+ *
+ * @param void *address - Base of the block.
+ * @return the number of bytes released, zero if the block was not allocated
+ * with vmm_alloc_nopage.
+ * */
 size_t vmm_free_nopage(void *address);
 
 int init_vmm(void *addr, size_t size);
@@ -26,12 +26,97 @@
 */
 #include <arctan.h>
 #include <global.h>
+#include <mm/algo/bitmap.h>
 #include <mm/algo/freelist.h>
+#include <mm/algo/range.h>
 #include <mm/pmm.h>
+#include <mm/percpu.h>
+#include <lib/util.h>
 #include <stdint.h>
 
-static struct ARC_FreelistMeta *arc_physical_mem = NULL;
-static struct ARC_FreelistMeta *arc_physical_low_mem = NULL;
+// Everything the bootstrapper hands over lies below 4 GiB, so a bitmap over
+// all of that memory bounds the storage needed to convert its lists
+#define PMM_BOOT_BITMAP_WORDS ((((uint64_t)1 << 32) / PAGE_SIZE / 64) + 256)
+
+// Layout of the freelist metas handed over by the 32-bit bootstrapper, every
+// field occupies 8 bytes of which only the lower 32-bits are meaningful
+struct pmm_boot_meta {
+	uint64_t head;
+	uint64_t base;
+	uint64_t ceil;
+	uint64_t next;
+	uint64_t object_size;
+	uint64_t free_objects;
+};
+
+static struct ARC_BitmapMeta *arc_physical_mem = NULL;
+static struct ARC_BitmapMeta *arc_physical_low_mem = NULL;
+
+// Enough to index every region of a fragmented memory map
+#define PMM_INDEX_ENTRIES 256
+
+static struct ARC_RangeIndex pmm_index = { 0 };
+static struct ARC_RangeIndex pmm_low_index = { 0 };
+static struct ARC_RangeEntry pmm_index_entries[PMM_INDEX_ENTRIES] = { 0 };
+static struct ARC_RangeEntry pmm_low_index_entries[PMM_INDEX_ENTRIES] = { 0 };
+
+static uint64_t pmm_boot_bitmaps[PMM_BOOT_BITMAP_WORDS] = { 0 };
+static size_t pmm_boot_bitmaps_used = 0;
+
+// Hot pages of each CPU, only single page allocations and frees go through here
+struct pmm_cpu_cache {
+	/// Lock for the cache, only contended if a thread migrates.
+	ARC_GenericMutex mutex;
+	/// Cached pages.
+	struct ARC_FreelistNode *head;
+	/// Number of cached pages.
+	size_t count;
+} __attribute__((aligned(ARC_MM_CACHE_LINE)));
+
+static struct pmm_cpu_cache pmm_cpu_caches[ARC_MM_MAX_CPUS] = { 0 };
+// An empty cache is refilled with this many pages
+static size_t pmm_cache_low = 32;
+// A cache holding this many pages is drained back down to pmm_cache_low
+static size_t pmm_cache_high = 128;
+// Most pages moved between a cache and the bitmaps under one lock of them
+#define PMM_CACHE_BATCH 64
+
+static void pmm_cache_refill(struct pmm_cpu_cache *cache) {
+	void *batch[PMM_CACHE_BATCH];
+
+	while (cache->count < pmm_cache_low) {
+		size_t wanted = min(pmm_cache_low - cache->count, PMM_CACHE_BATCH);
+		size_t taken = bitmap_alloc_n(arc_physical_mem, wanted, batch);
+
+		for (size_t i = 0; i < taken; i++) {
+			struct ARC_FreelistNode *page = batch[i];
+			page->next = cache->head;
+			cache->head = page;
+		}
+
+		cache->count += taken;
+
+		if (taken < wanted) {
+			break;
+		}
+	}
+}
+
+static void pmm_cache_drain(struct pmm_cpu_cache *cache, size_t keep) {
+	void *batch[PMM_CACHE_BATCH];
+
+	while (cache->count > keep) {
+		size_t count = min(cache->count - keep, PMM_CACHE_BATCH);
+
+		for (size_t i = 0; i < count; i++) {
+			batch[i] = cache->head;
+			cache->head = cache->head->next;
+		}
+
+		cache->count -= count;
+		bitmap_free_n(arc_physical_mem, count, batch);
+	}
+}
 
 void *pmm_alloc() {
 	if (arc_physical_mem == NULL) {
@@ -39,16 +124,56 @@ void *pmm_alloc() {
 		return NULL;
 	}
 
-	return freelist_alloc(arc_physical_mem);
+	struct pmm_cpu_cache *cache = &pmm_cpu_caches[ARC_MM_CPU_SLOT()];
+
+	mutex_lock(&cache->mutex);
+
+	if (cache->head == NULL) {
+		pmm_cache_refill(cache);
+	}
+
+	struct ARC_FreelistNode *page = cache->head;
+
+	if (page != NULL) {
+		cache->head = page->next;
+		cache->count--;
+	}
+
+	mutex_unlock(&cache->mutex);
+
+	return (void *)page;
 }
 
 void *pmm_contig_alloc(size_t objects) {
+	return pmm_contig_alloc_aligned(objects, 0);
+}
+
+void *pmm_contig_alloc_aligned(size_t objects, size_t align) {
 	if (arc_physical_mem == NULL) {
 		ARC_DEBUG(ERR, "arc_physical_mem is NULL!\n");
 		return NULL;
 	}
 
-	return freelist_contig_alloc(arc_physical_mem, objects);
+	void *address = pmm_try_contig_alloc_aligned(objects, align);
+
+	if (address == NULL) {
+		// Pages sitting in the caches may complete a run
+		pmm_drain_caches();
+		address = bitmap_contig_alloc_aligned(arc_physical_mem, objects, align);
+	}
+
+	return address;
+}
+
+void *pmm_try_contig_alloc_aligned(size_t objects, size_t align) {
+	if (arc_physical_mem == NULL) {
+		ARC_DEBUG(ERR, "arc_physical_mem is NULL!\n");
+		return NULL;
+	}
+
+	// The HHDM offset is aligned far beyond a page, so aligning the virtual
+	// address aligns the physical one
+	return bitmap_contig_alloc_aligned(arc_physical_mem, objects, align);
 }
 
 void *pmm_free(void *address) {
@@ -57,7 +182,30 @@ void *pmm_free(void *address) {
 		return NULL;
 	}
 
-	return freelist_free(arc_physical_mem, address);
+	// Cached pages are handed out without going through the bitmaps again,
+	// so anything they do not hold as allocated must be turned away here.
+	// A page freed twice while it still sits in a cache goes unnoticed
+	if (address == NULL || ((uintptr_t)address & (PAGE_SIZE - 1)) != 0 || !bitmap_is_allocated(arc_physical_mem, address)) {
+		ARC_DEBUG(ERR, "Cannot free %p\n", address);
+		return NULL;
+	}
+
+	struct pmm_cpu_cache *cache = &pmm_cpu_caches[ARC_MM_CPU_SLOT()];
+
+	mutex_lock(&cache->mutex);
+
+	struct ARC_FreelistNode *page = (struct ARC_FreelistNode *)address;
+	page->next = cache->head;
+	cache->head = page;
+	cache->count++;
+
+	if (cache->count >= pmm_cache_high) {
+		pmm_cache_drain(cache, pmm_cache_low);
+	}
+
+	mutex_unlock(&cache->mutex);
+
+	return address;
 }
 
 void *pmm_contig_free(void *address, size_t objects) {
@@ -66,7 +214,32 @@ void *pmm_contig_free(void *address, size_t objects) {
 		return NULL;
 	}
 
-	return freelist_contig_free(arc_physical_mem, address, objects);
+	return bitmap_contig_free(arc_physical_mem, address, objects);
+}
+
+int pmm_set_cache_watermarks(size_t low, size_t high) {
+	if (low == 0 || high <= low) {
+		return -1;
+	}
+
+	pmm_cache_low = low;
+	pmm_cache_high = high;
+
+	return 0;
+}
+
+void pmm_drain_caches() {
+	if (arc_physical_mem == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < ARC_MM_MAX_CPUS; i++) {
+		struct pmm_cpu_cache *cache = &pmm_cpu_caches[i];
+
+		mutex_lock(&cache->mutex);
+		pmm_cache_drain(cache, 0);
+		mutex_unlock(&cache->mutex);
+	}
 }
 
 void *pmm_low_alloc() {
@@ -75,7 +248,7 @@ void *pmm_low_alloc() {
 		return NULL;
 	}
 
-	return freelist_alloc(arc_physical_low_mem);
+	return bitmap_alloc(arc_physical_low_mem);
 }
 
 void *pmm_low_contig_alloc(size_t objects) {
@@ -84,7 +257,7 @@ void *pmm_low_contig_alloc(size_t objects) {
 		return NULL;
 	}
 
-	return freelist_contig_alloc(arc_physical_low_mem, objects);
+	return bitmap_contig_alloc(arc_physical_low_mem, objects);
 }
 
 void *pmm_low_free(void *address) {
@@ -93,7 +266,7 @@ void *pmm_low_free(void *address) {
 		return NULL;
 	}
 
-	return freelist_free(arc_physical_low_mem, address);
+	return bitmap_free(arc_physical_low_mem, address);
 }
 
 void *pmm_low_contig_free(void *address, size_t objects) {
@@ -102,66 +275,100 @@ void *pmm_low_contig_free(void *address, size_t objects) {
 		return NULL;
 	}
 
-	return freelist_contig_free(arc_physical_low_mem, address, objects);
+	return bitmap_contig_free(arc_physical_low_mem, address, objects);
 }
 
-int init_pmm(struct ARC_MMap *mmap, int entries) {
-	if (mmap == NULL || entries == 0) {
-		ARC_DEBUG(ERR, "Failed to initialize 64-bit PMM (one or more are NULL: %p %d)\n", mmap, entries);
-		ARC_HANG;
-	}
+// Convert a chain of bootstrap freelists into bitmaps. Each bitmap meta takes
+// the place of the freelist meta at the base of its region, the bitmaps
+// themselves come from pmm_boot_bitmaps
+static struct ARC_BitmapMeta *pmm_convert_boot_lists(uint64_t phys_meta, uint64_t *highest_alloc) {
+	struct ARC_BitmapMeta *first = NULL;
+	struct ARC_BitmapMeta *last = NULL;
+
+	while ((phys_meta & UINT32_MAX) != 0) {
+		struct pmm_boot_meta *boot = (struct pmm_boot_meta *)ARC_PHYS_TO_HHDM(phys_meta & UINT32_MAX);
+
+		// Copy out everything needed, the bitmap meta overwrites the old one.
+		// Head may an HHDM address if the list has been used therefore ignore
+		// the upper 32-bits and convert it to an HHDM address anyway
+		uint64_t head = boot->head & UINT32_MAX;
+		uint64_t object_size = boot->object_size;
+		uint64_t base = ARC_PHYS_TO_HHDM(boot->base & UINT32_MAX);
+		uint64_t ceil = ARC_PHYS_TO_HHDM(boot->ceil & UINT32_MAX) + object_size;
+		phys_meta = boot->next;
+
+		size_t words = bitmap_bookkeeping_size(base, ceil, object_size) / sizeof(uint64_t);
+
+		if (pmm_boot_bitmaps_used + words > PMM_BOOT_BITMAP_WORDS) {
+			ARC_DEBUG(ERR, "\tOut of bitmap storage, dropping 0x%"PRIx64" -> 0x%"PRIx64"\n", base, ceil);
+			continue;
+		}
 
-	mmap = (struct ARC_MMap *)ARC_PHYS_TO_HHDM(mmap);
+		struct ARC_BitmapMeta *meta = (struct ARC_BitmapMeta *)boot;
 
-	arc_physical_mem = (struct ARC_FreelistMeta *)ARC_PHYS_TO_HHDM(Arc_BootMeta->pmm_state);
-	arc_physical_low_mem = (struct ARC_FreelistMeta *)ARC_PHYS_TO_HHDM(Arc_BootMeta->pmm_low_state);
+		if (init_static_bitmap(meta, &pmm_boot_bitmaps[pmm_boot_bitmaps_used], base, ceil, object_size) != 0) {
+			ARC_DEBUG(ERR, "\tFailed to create bitmap for 0x%"PRIx64" -> 0x%"PRIx64"\n", base, ceil);
+			continue;
+		}
 
-	ARC_DEBUG(INFO, "Converting bootstrap allocator to use HHDM addresses\n");
+		pmm_boot_bitmaps_used += words;
 
-	// All addresses in the meta remain physical, need to
-	// convert to HHDM addresses (except for head)
-	struct ARC_FreelistMeta *current = arc_physical_low_mem;
-	while (current != NULL) {
-		current->base = (struct ARC_FreelistNode *)ARC_PHYS_TO_HHDM(current->base);
-		current->ceil = (struct ARC_FreelistNode *)ARC_PHYS_TO_HHDM(current->ceil);
-		// Head may an HHDM address if the list has been used
-		// therefore ignore the upper 32-bits and convert it to
-		// an HHDM address anyway
-		current->head = (struct ARC_FreelistNode *)ARC_PHYS_TO_HHDM(((uint64_t)current->head) & UINT32_MAX);
+		// Mark every object on the freelist as free
+		while (head != 0) {
+			struct ARC_FreelistNode *node = (struct ARC_FreelistNode *)ARC_PHYS_TO_HHDM(head);
+			head = ((uint64_t)node->next) & UINT32_MAX;
 
-		if (current->next != NULL) {
-			current->next = (struct ARC_FreelistMeta *)ARC_PHYS_TO_HHDM(current->next);
+			if (bitmap_free(meta, node) == NULL) {
+				break;
+			}
 		}
 
-		current = current->next;
-	}
+		ARC_DEBUG(INFO, "\tConverted { B:%p C:%p F:%lu SZ:%lu }\n", meta->base, meta->ceil, meta->free_objects, meta->object_size);
 
-	ARC_DEBUG(INFO, "Converted low: { B:%p C:%p H:%p SZ:%lu }\n", arc_physical_low_mem->base, arc_physical_low_mem->ceil, arc_physical_low_mem->head, arc_physical_low_mem->object_size);
+		if (first == NULL) {
+			first = meta;
+		} else {
+			link_bitmaps(last, meta);
+		}
 
-	current = arc_physical_mem;
-	struct ARC_FreelistMeta *highest_meta = arc_physical_mem;
-	while (current != NULL) {
-		current->base = (struct ARC_FreelistNode *)ARC_PHYS_TO_HHDM(current->base);
-		current->ceil = (struct ARC_FreelistNode *)ARC_PHYS_TO_HHDM(current->ceil);
-		// Head may an HHDM address if the list has been used
-		// therefore ignore the upper 32-bits and convert it to
-		// an HHDM address anyway
-		current->head = (struct ARC_FreelistNode *)ARC_PHYS_TO_HHDM(((uint64_t)current->head) & UINT32_MAX);
+		last = meta;
 
-		if (current->next != NULL) {
-			current->next = (struct ARC_FreelistMeta *)ARC_PHYS_TO_HHDM(current->next);
+		if (highest_alloc != NULL && ceil > *highest_alloc) {
+			*highest_alloc = ceil;
 		}
-	
-		highest_meta = current;
-		current = current->next;
 	}
 
-	ARC_DEBUG(INFO, "Converted high: { B:%p C:%p H:%p SZ:%lu }\n", arc_physical_mem->base, arc_physical_mem->ceil, arc_physical_mem->head, arc_physical_mem->object_size);
+	return first;
+}
 
-	uint64_t highest_alloc = (uint64_t)highest_meta->ceil;
+int init_pmm(struct ARC_MMap *mmap, int entries) {
+	if (mmap == NULL || entries == 0) {
+		ARC_DEBUG(ERR, "Failed to initialize 64-bit PMM (one or more are NULL: %p %d)\n", mmap, entries);
+		ARC_HANG;
+	}
+
+	mmap = (struct ARC_MMap *)ARC_PHYS_TO_HHDM(mmap);
+
+	for (int i = 0; i < ARC_MM_MAX_CPUS; i++) {
+		init_static_mutex(&pmm_cpu_caches[i].mutex);
+	}
+
+	ARC_DEBUG(INFO, "Converting bootstrap allocator to bitmaps\n");
+
+	arc_physical_low_mem = pmm_convert_boot_lists(Arc_BootMeta->pmm_low_state, NULL);
+
+	uint64_t highest_alloc = 0;
+	arc_physical_mem = pmm_convert_boot_lists(Arc_BootMeta->pmm_state, &highest_alloc);
+
+	if (arc_physical_mem == NULL) {
+		ARC_DEBUG(ERR, "Bootstrapper handed over no usable memory\n");
+		ARC_HANG;
+	}
 
 	ARC_DEBUG(INFO, "Highest allocatable address: 0x%"PRIx64"\n", highest_alloc);
 
+	struct ARC_BitmapMeta *highest_meta = arc_physical_mem;
+
 	for (int i = 0; i < entries; i++) {
 		struct ARC_MMap entry = mmap[i];
 
@@ -181,9 +388,9 @@ int init_pmm(struct ARC_MMap *mmap, int entries) {
 		uintptr_t ceil = ((entry.base + entry.len) >> 12) << 12;
 
 		// Found a memory entry that is not yet in the allocator
-		struct ARC_FreelistMeta *list = init_freelist(ARC_PHYS_TO_HHDM(base), ARC_PHYS_TO_HHDM(ceil), PAGE_SIZE);
+		struct ARC_BitmapMeta *list = init_bitmap(ARC_PHYS_TO_HHDM(base), ARC_PHYS_TO_HHDM(ceil), PAGE_SIZE);
 
-		int ret = link_freelists(highest_meta, list);
+		int ret = link_bitmaps(highest_meta, list);
 		if (ret != 0) {
 			ARC_DEBUG(ERR, "\t\tFailed to link lists (%d)\n", ret);
 			continue;
@@ -194,6 +401,18 @@ int init_pmm(struct ARC_MMap *mmap, int entries) {
 		highest_meta = list;
 	}
 
+	// Frees go straight to the owning region
+	init_range_index(&pmm_index, pmm_index_entries, PMM_INDEX_ENTRIES);
+	init_range_index(&pmm_low_index, pmm_low_index_entries, PMM_INDEX_ENTRIES);
+
+	if (bitmap_attach_index(arc_physical_mem, &pmm_index) != 0) {
+		ARC_DEBUG(ERR, "Failed to index all regions\n");
+	}
+
+	if (arc_physical_low_mem != NULL && bitmap_attach_index(arc_physical_low_mem, &pmm_low_index) != 0) {
+		ARC_DEBUG(ERR, "Failed to index all low regions\n");
+	}
+
 	ARC_DEBUG(INFO, "Finished setting up PMM\n");
 
 	return 0;
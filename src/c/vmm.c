@@ -26,21 +26,276 @@
 */
 #include <mm/vmm.h>
 #include <mm/algo/buddy.h>
+#include <mm/algo/pagemap.h>
 #include <arch/pager.h>
 #include <lib/util.h>
 
+// Freed blocks of up to PAGE_SIZE << (VMM_CACHE_ORDERS - 1) bytes (1 MiB) are
+// kept mapped, so that allocating the same size again takes neither the buddy
+// nor the page tables
+#define VMM_CACHE_ORDERS 9
+// States of a block, kept in the low bits of its entry in vmm_blocks under
+// its mapped length. A block in the cache is caught when freed again
+#define VMM_BLOCK_CACHED 1
+// A block from vmm_alloc_nopage, which has no pages to cache it in
+#define VMM_BLOCK_NOPAGE 2
+#define VMM_BLOCK_STATE (PAGE_SIZE - 1)
+
+// Written at the base of a cached block, which stays mapped
+struct vmm_cached {
+	/// Blocks of the same order, most recently freed first.
+	struct vmm_cached *next;
+	struct vmm_cached *prev;
+	/// Blocks of every order, most recently freed first.
+	struct vmm_cached *newer;
+	struct vmm_cached *older;
+	/// The block is PAGE_SIZE << order bytes.
+	int order;
+	/// Bytes from the base of the block which are mapped.
+	size_t mapped;
+};
+
+struct vmm_cache {
+	ARC_GenericMutex mutex;
+	struct vmm_cached *orders[VMM_CACHE_ORDERS];
+	/// Ends of the list of every order, the oldest is evicted first.
+	struct vmm_cached *newest;
+	struct vmm_cached *oldest;
+	/// Bytes mapped in cached blocks.
+	size_t bytes;
+};
+
 static struct ARC_BuddyMeta vmm_meta = { 0 };
+static struct vmm_cache vmm_cache = { 0 };
+// Bytes mapped from the base of each block and its VMM_BLOCK_* state, the
+// rest of a block is mapped once it is grown into
+static struct ARC_PageMap vmm_blocks = { 0 };
+// Most bytes kept in cached blocks
+static size_t vmm_cache_budget = 4 * 1024 * 1024;
+
+// Return: bytes mapped from the base of an allocated block, zero if it is
+// not allocated
+static size_t vmm_mapped_get(void *address) {
+	uintptr_t block = (uintptr_t)pagemap_get(&vmm_blocks, address);
+
+	return (block & VMM_BLOCK_STATE) == 0 ? block : 0;
+}
+
+// Map the bytes between the mapped length of a block and the given length
+// Return: zero upon success
+static int vmm_map_to(void *address, size_t mapped, size_t length) {
+	if (length > mapped && pager_fly_map(NULL, (uintptr_t)address + mapped, length - mapped, 1 << ARC_PAGER_RW) != 0) {
+		ARC_DEBUG(ERR, "Failed to fly map %p (%lu B)\n", address + mapped, length - mapped);
+		return -1;
+	}
+
+	if (pagemap_set(&vmm_blocks, address, 1, (void *)length) != 0) {
+		ARC_DEBUG(ERR, "Failed to track %p\n", address);
+		pager_fly_unmap(NULL, (uintptr_t)address + mapped, length - mapped);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Unmap and release a block to the buddy allocator
+static void *vmm_release(void *address) {
+	size_t mapped = (uintptr_t)pagemap_get(&vmm_blocks, address) & ~(uintptr_t)VMM_BLOCK_STATE;
+
+	if (buddy_free(&vmm_meta, address) == 0) {
+		return NULL;
+	}
+
+	pagemap_set(&vmm_blocks, address, 1, NULL);
+
+	if (pager_fly_unmap(NULL, (uintptr_t)address, mapped) != 0) {
+		return NULL;
+	}
+
+	return address;
+}
+
+// Remove a block from both lists, the cache must be locked
+static void vmm_cache_unlink(struct vmm_cached *block) {
+	if (block->prev != NULL) {
+		block->prev->next = block->next;
+	} else {
+		vmm_cache.orders[block->order] = block->next;
+	}
+
+	if (block->next != NULL) {
+		block->next->prev = block->prev;
+	}
+
+	if (block->newer != NULL) {
+		block->newer->older = block->older;
+	} else {
+		vmm_cache.newest = block->older;
+	}
+
+	if (block->older != NULL) {
+		block->older->newer = block->newer;
+	} else {
+		vmm_cache.oldest = block->newer;
+	}
+
+	vmm_cache.bytes -= block->mapped;
+	// The entry was set when the block was allocated, so this cannot fail
+	pagemap_set(&vmm_blocks, block, 1, (void *)block->mapped);
+}
+
+// Release the least recently freed blocks until the cache holds at most
+// budget bytes
+// Return: number of bytes released
+static size_t vmm_cache_trim(size_t budget) {
+	struct vmm_cached *evicted = NULL;
+	size_t released = 0;
+
+	mutex_lock(&vmm_cache.mutex);
+
+	while (vmm_cache.bytes > budget) {
+		struct vmm_cached *block = vmm_cache.oldest;
+		vmm_cache_unlink(block);
+
+		block->next = evicted;
+		evicted = block;
+	}
+
+	mutex_unlock(&vmm_cache.mutex);
+
+	// Page table edits are kept out of the lock
+	while (evicted != NULL) {
+		struct vmm_cached *next = evicted->next;
+		size_t size = evicted->mapped;
+
+		if (vmm_release(evicted) != NULL) {
+			released += size;
+		}
+
+		evicted = next;
+	}
+
+	return released;
+}
+
+// Return: the most recently freed block of the given order, NULL if none is cached
+static void *vmm_cache_take(int order) {
+	// Peek without the lock, a stale answer only costs a trip to the buddy
+	// allocator
+	if (order >= VMM_CACHE_ORDERS || vmm_cache.orders[order] == NULL) {
+		return NULL;
+	}
+
+	mutex_lock(&vmm_cache.mutex);
+
+	struct vmm_cached *block = vmm_cache.orders[order];
+
+	if (block != NULL) {
+		vmm_cache_unlink(block);
+	}
+
+	mutex_unlock(&vmm_cache.mutex);
+
+	return block;
+}
+
+// Return: zero if the block was cached, 1 if it already was
+static int vmm_cache_put(void *address, size_t size) {
+	int order = __builtin_ctzl(size / PAGE_SIZE);
+
+	if (order >= VMM_CACHE_ORDERS || size > vmm_cache_budget) {
+		return -1;
+	}
+
+	struct vmm_cached *block = (struct vmm_cached *)address;
+
+	mutex_lock(&vmm_cache.mutex);
+
+	// The state is only changed under the lock, so of two frees of a block
+	// the second sees it cached
+	uintptr_t state = (uintptr_t)pagemap_get(&vmm_blocks, address);
+
+	if ((state & VMM_BLOCK_CACHED) != 0) {
+		mutex_unlock(&vmm_cache.mutex);
+		return 1;
+	}
+
+	pagemap_set(&vmm_blocks, address, 1, (void *)(state | VMM_BLOCK_CACHED));
+
+	block->order = order;
+	block->mapped = state;
+	block->prev = NULL;
+	block->next = vmm_cache.orders[order];
+	block->newer = NULL;
+	block->older = vmm_cache.newest;
+
+	if (block->next != NULL) {
+		block->next->prev = block;
+	}
+
+	if (block->older != NULL) {
+		block->older->newer = block;
+	} else {
+		vmm_cache.oldest = block;
+	}
+
+	vmm_cache.orders[order] = block;
+	vmm_cache.newest = block;
+	vmm_cache.bytes += block->mapped;
+
+	int over = vmm_cache.bytes > vmm_cache_budget;
+
+	mutex_unlock(&vmm_cache.mutex);
+
+	if (over) {
+		vmm_cache_trim(vmm_cache_budget);
+	}
+
+	return 0;
+}
 
 void *vmm_alloc(size_t size) {
-	void *virtual = buddy_alloc(&vmm_meta, size);
+	size_t block = max(size, PAGE_SIZE);
+	SIZE_T_NEXT_POW2(block);
+
+	// Only the pages asked for are mapped, the rest of the block stays
+	// reserved for vmm_grow to map
+	size_t length = ALIGN(max(size, PAGE_SIZE), PAGE_SIZE);
+	void *virtual = vmm_cache_take(__builtin_ctzl(block / PAGE_SIZE));
+
+	if (virtual != NULL) {
+		// A cached block keeps what it had mapped, which may be more
+		if (vmm_map_to(virtual, vmm_mapped_get(virtual), length) == 0) {
+			return virtual;
+		}
+
+		vmm_release(virtual);
+	}
+
+	virtual = buddy_alloc(&vmm_meta, size);
+
+	if (virtual == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate\n");
+		return NULL;
+	}
+
+	if (vmm_map_to(virtual, 0, length) != 0) {
+		buddy_free(&vmm_meta, virtual);
+		return NULL;
+	}
+
+	return virtual;
+}
+
+void *vmm_alloc_aligned(size_t size, size_t align) {
+	void *virtual = buddy_alloc_aligned(&vmm_meta, size, align);
 
 	if (virtual == NULL) {
 		ARC_DEBUG(ERR, "Failed to allocate\n");
 		return NULL;
 	}
 
-	if (pager_fly_map(NULL, (uintptr_t)virtual, size, 1 << ARC_PAGER_RW) != 0) {
-		ARC_DEBUG(ERR, "Failed to fly map %p (%lu B)\n", virtual, size);
+	if (vmm_map_to(virtual, 0, ALIGN(max(size, PAGE_SIZE), PAGE_SIZE)) != 0) {
 		buddy_free(&vmm_meta, virtual);
 		return NULL;
 	}
@@ -49,31 +304,191 @@ void *vmm_alloc(size_t size) {
 }
 
 void *vmm_free(void *address) {
-	size_t freed = buddy_free(&vmm_meta, address);
+	size_t size = buddy_size(&vmm_meta, address);
 
-	if (freed == 0) {
+	if (size == 0) {
 		return NULL;
 	}
 
-	if (pager_fly_unmap(NULL, (uintptr_t)address, freed) != 0) {
+	if (((uintptr_t)pagemap_get(&vmm_blocks, address) & VMM_BLOCK_NOPAGE) != 0) {
+		ARC_DEBUG(ERR, "Cannot free %p, it was allocated with vmm_alloc_nopage\n", address);
+		return NULL;
+	}
+
+	int cached = vmm_cache_put(address, size);
+
+	if (cached == 0) {
+		return address;
+	}
+
+	if (cached > 0) {
+		ARC_DEBUG(ERR, "Cannot free %p, it is already free\n", address);
+		return NULL;
+	}
+
+	return vmm_release(address);
+}
+
+size_t vmm_cache_flush() {
+	return vmm_cache_trim(0);
+}
+
+size_t vmm_set_cache_budget(size_t bytes) {
+	vmm_cache_budget = bytes;
+
+	return vmm_cache_trim(bytes);
+}
+
+int vmm_contains(void *address) {
+	return address >= vmm_meta.base && address < vmm_meta.ceil;
+}
+
+size_t vmm_size(void *address) {
+	return vmm_mapped_get(address);
+}
+
+void *vmm_grow(void *address, size_t size) {
+	size_t block = buddy_size(&vmm_meta, address);
+	size_t mapped = vmm_mapped_get(address);
+
+	if (block == 0 || mapped == 0) {
+		return NULL;
+	}
+
+	size_t length = ALIGN(size, PAGE_SIZE);
+
+	if (length <= mapped) {
+		return address;
+	}
+
+	// Map the rest of the block first, and only take in buddies for more
+	if (length > block && buddy_grow(&vmm_meta, address, length) == 0) {
+		return NULL;
+	}
+
+	if (vmm_map_to(address, mapped, length) != 0) {
+		buddy_shrink(&vmm_meta, address, block);
 		return NULL;
 	}
 
 	return address;
 }
 
+// Move the mappings of count pages from one virtual range to another
+// Return: number of pages moved
+static size_t vmm_move_pages(void *from, void *to, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		uintptr_t offset = i * PAGE_SIZE;
+		void *physical = NULL;
+
+		if (pager_unmap(NULL, (uintptr_t)from + offset, PAGE_SIZE, &physical) != 0) {
+			return i;
+		}
+
+		if (pager_map(NULL, (uintptr_t)to + offset, (uintptr_t)physical, PAGE_SIZE, 1 << ARC_PAGER_RW) != 0) {
+			// Put the page back where it was
+			pager_map(NULL, (uintptr_t)from + offset, (uintptr_t)physical, PAGE_SIZE, 1 << ARC_PAGER_RW);
+			return i;
+		}
+	}
+
+	return count;
+}
+
+void *vmm_remap(void *address, size_t size) {
+	size_t mapped = vmm_mapped_get(address);
+
+	if (mapped == 0) {
+		return NULL;
+	}
+
+	if (size <= mapped || vmm_grow(address, size) != NULL) {
+		return address;
+	}
+
+	void *new = buddy_alloc(&vmm_meta, size);
+
+	if (new == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate\n");
+		return NULL;
+	}
+
+	size_t pages = mapped / PAGE_SIZE;
+	size_t moved = vmm_move_pages(address, new, pages);
+
+	if (moved != pages || vmm_map_to(new, mapped, ALIGN(size, PAGE_SIZE)) != 0) {
+		ARC_DEBUG(ERR, "Failed to remap %p to %p\n", address, new);
+		vmm_move_pages(new, address, moved);
+		buddy_free(&vmm_meta, new);
+		return NULL;
+	}
+
+	// The pages now belong to the new range, only release the old one
+	pagemap_set(&vmm_blocks, address, 1, NULL);
+	buddy_free(&vmm_meta, address);
+
+	return new;
+}
+
+void *vmm_shrink(void *address, size_t size) {
+	size_t mapped = vmm_mapped_get(address);
+
+	if (mapped == 0) {
+		return NULL;
+	}
+
+	size_t length = ALIGN(max(size, PAGE_SIZE), PAGE_SIZE);
+
+	buddy_shrink(&vmm_meta, address, length);
+
+	if (length < mapped) {
+		if (pager_fly_unmap(NULL, (uintptr_t)address + length, mapped - length) != 0) {
+			ARC_DEBUG(ERR, "Failed to unmap %p (%lu B)\n", address + length, mapped - length);
+		}
+
+		pagemap_set(&vmm_blocks, address, 1, (void *)length);
+	}
+
+	return address;
+}
+
 void *vmm_alloc_nopage(size_t size) {
 	if (size < PAGE_SIZE) {
 		size = PAGE_SIZE;
 	}
 
-	return buddy_alloc(&vmm_meta, size);
+	void *virtual = buddy_alloc(&vmm_meta, size);
+
+	if (virtual == NULL) {
+		return NULL;
+	}
+
+	if (pagemap_set(&vmm_blocks, virtual, 1, (void *)VMM_BLOCK_NOPAGE) != 0) {
+		ARC_DEBUG(ERR, "Failed to track %p\n", virtual);
+		buddy_free(&vmm_meta, virtual);
+		return NULL;
+	}
+
+	return virtual;
 }
 
 size_t vmm_free_nopage(void *address) {
+	if (((uintptr_t)pagemap_get(&vmm_blocks, address) & VMM_BLOCK_NOPAGE) == 0) {
+		ARC_DEBUG(ERR, "Cannot free %p, it was not allocated with vmm_alloc_nopage\n", address);
+		return 0;
+	}
+
+	pagemap_set(&vmm_blocks, address, 1, NULL);
+
 	return buddy_free(&vmm_meta, address);
 }
 
 int init_vmm(void *addr, size_t size) {
+	init_static_mutex(&vmm_cache.mutex);
+
+	if (init_pagemap(&vmm_blocks) != 0) {
+		return -1;
+	}
+
 	return init_buddy(&vmm_meta, addr, size, PAGE_SIZE);
 }
@@ -0,0 +1,18 @@
+/**
+ * Hosted stand-in for the kernel's arch/pager.h, the tests back the VMM's
+ * range with memory they protect and unprotect page by page.
+*/
+#ifndef ARC_TEST_ARCH_PAGER_H
+#define ARC_TEST_ARCH_PAGER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ARC_PAGER_RW 1
+
+int pager_map(void *page_tables, uintptr_t virtual, uintptr_t physical, size_t size, uint32_t attributes);
+int pager_unmap(void *page_tables, uintptr_t virtual, size_t size, void **physical);
+int pager_fly_map(void *page_tables, uintptr_t virtual, size_t size, uint32_t attributes);
+int pager_fly_unmap(void *page_tables, uintptr_t virtual, size_t size);
+
+#endif
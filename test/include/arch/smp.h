@@ -0,0 +1,12 @@
+/**
+ * Hosted stand-in for the kernel's arch/smp.h, the tests decide which CPU
+ * each of their threads runs on.
+*/
+#ifndef ARC_TEST_ARCH_SMP_H
+#define ARC_TEST_ARCH_SMP_H
+
+#include <stdint.h>
+
+uint32_t smp_get_processor_id();
+
+#endif
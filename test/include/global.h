@@ -0,0 +1,24 @@
+/**
+ * Hosted stand-in for the kernel's global.h, only provides what the
+ * memory management code under test relies on.
+*/
+#ifndef ARC_TEST_GLOBAL_H
+#define ARC_TEST_GLOBAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <lib/util.h>
+
+#define PAGE_SIZE 0x1000
+
+#define ARC_DEBUG(level, fmt, ...) printf("[" #level "] " fmt, ##__VA_ARGS__)
+
+struct ARC_MMap {
+	uint64_t base;
+	uint64_t len;
+	uint32_t type;
+};
+
+#endif
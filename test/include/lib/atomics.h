@@ -1 +1,18 @@
+/**
+ * Hosted stand-in for the kernel's lib/atomics.h, backed by pthread mutexes
+ * * so that tests may run the code under test from several threads.
+*/
+#ifndef ARC_TEST_LIB_ATOMICS_H
+#define ARC_TEST_LIB_ATOMICS_H
 
+#include <pthread.h>
+
+typedef pthread_mutex_t ARC_GenericMutex;
+
+void test_unlocked(ARC_GenericMutex *mutex);
+
+#define init_static_mutex(mutex) pthread_mutex_init((mutex), NULL)
+#define mutex_lock(mutex) pthread_mutex_lock(mutex)
+#define mutex_unlock(mutex) (pthread_mutex_unlock(mutex), test_unlocked(mutex))
+
+#endif
@@ -0,0 +1,15 @@
+/**
+ * Hosted stand-in for the kernel's lib/util.h.
+*/
+#ifndef ARC_TEST_LIB_UTIL_H
+#define ARC_TEST_LIB_UTIL_H
+
+#include <string.h>
+
+#define abs(x) ((x) < 0 ? -(x) : (x))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define ALIGN(v, a) (((v) + ((a) - 1)) & ~((a) - 1))
+#define SIZE_T_NEXT_POW2(v) do { v--; v |= v >> 1; v |= v >> 2; v |= v >> 4; v |= v >> 8; v |= v >> 16; v |= v >> 32; v++; } while (0)
+
+#endif
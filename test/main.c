@@ -1,3 +1,737 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <mm/freelist.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <global.h>
+#include <mm/algo/buddy.h>
+#include <mm/algo/bitmap.h>
+#include <mm/algo/range.h>
+#include <mm/algo/freelist.h>
+#include <mm/algo/slab.h>
+#include <mm/vmm.h>
+#include <arch/pager.h>
+
+#define ARENA_PAGES 1024
+
+static int failed = 0;
+
+#define EXPECT(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("%s:%d: expectation failed: %s\n", __FILE__, __LINE__, #cond); \
+			failed = 1; \
+		} \
+	} while (0)
+
+// Processor the calling thread pretends to run on
+static __thread uint32_t test_cpu = 0;
+
+uint32_t smp_get_processor_id() {
+	return test_cpu;
+}
+
+// Mutex whose next unlock calls unlock_hook, NULL for none
+static ARC_GenericMutex *unlock_watch = NULL;
+static void (*unlock_hook)() = NULL;
+
+void test_unlocked(ARC_GenericMutex *mutex) {
+	if (mutex == NULL || __atomic_load_n(&unlock_watch, __ATOMIC_RELAXED) != mutex) {
+		return;
+	}
+
+	unlock_watch = NULL;
+	unlock_hook();
+}
+
+void *pmm_contig_alloc(size_t objects) {
+	void *pages = aligned_alloc(PAGE_SIZE, objects * PAGE_SIZE);
+
+	if (pages != NULL) {
+		memset(pages, 0, objects * PAGE_SIZE);
+	}
+
+	return pages;
+}
+
+void *pmm_alloc() {
+	return pmm_contig_alloc(1);
+}
+
+void *pmm_contig_free(void *address, size_t objects) {
+	// Keep the pages and make them inaccessible, so that anything still
+	// reading them faults instead of finding them handed out again
+	mprotect(address, objects * PAGE_SIZE, PROT_NONE);
+
+	return address;
+}
+
+void *pmm_free(void *address) {
+	return pmm_contig_free(address, 1);
+}
+
+// Bytes mapped through the pager stand-ins
+static size_t pager_mapped = 0;
+
+int pager_fly_map(void *page_tables, uintptr_t virtual, size_t size, uint32_t attributes) {
+	(void)page_tables;
+	(void)attributes;
+
+	pager_mapped += size;
+
+	return mprotect((void *)virtual, size, PROT_READ | PROT_WRITE);
+}
+
+int pager_fly_unmap(void *page_tables, uintptr_t virtual, size_t size) {
+	(void)page_tables;
+
+	pager_mapped -= size;
+
+	// Drop the contents as well, as a fresh page would not have them
+	madvise((void *)virtual, size, MADV_DONTNEED);
+
+	return mprotect((void *)virtual, size, PROT_NONE);
+}
+
+// The "physical" pages handed between the two are copies of the contents
+int pager_unmap(void *page_tables, uintptr_t virtual, size_t size, void **physical) {
+	*physical = malloc(size);
+	memcpy(*physical, (void *)virtual, size);
+
+	return pager_fly_unmap(page_tables, virtual, size);
+}
+
+int pager_map(void *page_tables, uintptr_t virtual, uintptr_t physical, size_t size, uint32_t attributes) {
+	if (pager_fly_map(page_tables, virtual, size, attributes) != 0) {
+		return -1;
+	}
+
+	memcpy((void *)virtual, (void *)physical, size);
+	free((void *)physical);
+
+	return 0;
+}
+
+// Allocate and free blocks of varied sizes in a shuffled order, a fully freed
+// arena must coalesce back into a single block spanning all of it
+static void test_buddy_fragmentation() {
+	struct ARC_BuddyMeta meta = { 0 };
+	// The arena is never dereferenced by the allocator
+	void *arena = (void *)0x100000000;
+	size_t size = ARENA_PAGES * PAGE_SIZE;
+
+	EXPECT(init_buddy(&meta, arena, size, PAGE_SIZE) == 0);
+
+	void *allocations[ARENA_PAGES] = { 0 };
+	int count = 0;
+
+	srand(0xB0DD1);
+
+	for (int round = 0; round < 64; round++) {
+		// Fill up with sizes between one and sixteen pages
+		while (count < ARENA_PAGES) {
+			void *address = buddy_alloc(&meta, ((rand() % 16) + 1) * PAGE_SIZE);
+
+			if (address == NULL) {
+				break;
+			}
+
+			allocations[count++] = address;
+		}
+
+		// Free a random half
+		for (int i = count / 2; i > 0; i--) {
+			int victim = rand() % count;
+			EXPECT(buddy_free(&meta, allocations[victim]) != 0);
+			allocations[victim] = allocations[--count];
+		}
+	}
+
+	while (count > 0) {
+		int victim = rand() % count;
+		EXPECT(buddy_free(&meta, allocations[victim]) != 0);
+		allocations[victim] = allocations[--count];
+	}
+
+	void *whole = buddy_alloc(&meta, size);
+	EXPECT(whole == arena);
+	EXPECT(buddy_free(&meta, whole) == size);
+	EXPECT(buddy_free(&meta, whole) == 0);
+
+	free(meta.tree);
+}
+
+// Blocks grow in place into free upper buddies and shrink back, releasing
+// the halves they no longer need
+static void test_buddy_resize() {
+	struct ARC_BuddyMeta meta = { 0 };
+	void *arena = (void *)0x100000000;
+	size_t size = ARENA_PAGES * PAGE_SIZE;
+
+	EXPECT(init_buddy(&meta, arena, size, PAGE_SIZE) == 0);
+
+	void *a = buddy_alloc(&meta, PAGE_SIZE);
+	EXPECT(a == arena);
+	EXPECT(buddy_size(&meta, a) == PAGE_SIZE);
+
+	EXPECT(buddy_grow(&meta, a, 5 * PAGE_SIZE) == 8 * PAGE_SIZE);
+	EXPECT(buddy_size(&meta, a) == 8 * PAGE_SIZE);
+
+	// The next block lands right after the grown one and pins it
+	void *b = buddy_alloc(&meta, PAGE_SIZE);
+	EXPECT(b == arena + 8 * PAGE_SIZE);
+	EXPECT(buddy_grow(&meta, a, 16 * PAGE_SIZE) == 0);
+	EXPECT(buddy_grow(&meta, b, 2 * PAGE_SIZE) == 2 * PAGE_SIZE);
+	EXPECT(buddy_grow(&meta, b + PAGE_SIZE, 2 * PAGE_SIZE) == 0);
+
+	EXPECT(buddy_shrink(&meta, a, 2 * PAGE_SIZE) == 2 * PAGE_SIZE);
+	EXPECT(buddy_alloc(&meta, 4 * PAGE_SIZE) == arena + 4 * PAGE_SIZE);
+	EXPECT(buddy_free(&meta, arena + 4 * PAGE_SIZE) == 4 * PAGE_SIZE);
+
+	EXPECT(buddy_free(&meta, a) == 2 * PAGE_SIZE);
+	EXPECT(buddy_free(&meta, b) == 2 * PAGE_SIZE);
+
+	void *whole = buddy_alloc(&meta, size);
+	EXPECT(whole == arena);
+	EXPECT(buddy_free(&meta, whole) == size);
+
+	free(meta.tree);
+}
+
+// Aligned blocks are carved out of larger free blocks even when the arena
+// itself is not aligned, and everything still coalesces once freed
+static void test_buddy_aligned() {
+	struct ARC_BuddyMeta meta = { 0 };
+	void *arena = (void *)0x100002000;
+	size_t size = ARENA_PAGES * PAGE_SIZE;
+	size_t align = 16 * PAGE_SIZE;
+
+	EXPECT(init_buddy(&meta, arena, size, PAGE_SIZE) == 0);
+
+	void *a = buddy_alloc_aligned(&meta, PAGE_SIZE, align);
+	EXPECT(a != NULL && ((uintptr_t)a & (align - 1)) == 0);
+	EXPECT(buddy_size(&meta, a) == PAGE_SIZE);
+
+	void *b = buddy_alloc_aligned(&meta, 2 * PAGE_SIZE, align);
+	EXPECT(b != NULL && b != a && ((uintptr_t)b & (align - 1)) == 0);
+
+	// The pages skipped over are still free
+	void *c = buddy_alloc(&meta, 8 * PAGE_SIZE);
+	void *d = buddy_alloc(&meta, 8 * PAGE_SIZE);
+	EXPECT((c == arena && d == arena + 16 * PAGE_SIZE) || (d == arena && c == arena + 16 * PAGE_SIZE));
+
+	EXPECT(buddy_free(&meta, a) == PAGE_SIZE);
+	EXPECT(buddy_free(&meta, b) == 2 * PAGE_SIZE);
+	EXPECT(buddy_free(&meta, c) == 8 * PAGE_SIZE);
+	EXPECT(buddy_free(&meta, d) == 8 * PAGE_SIZE);
+
+	void *whole = buddy_alloc(&meta, size);
+	EXPECT(whole == arena);
+	EXPECT(buddy_free(&meta, whole) == size);
+
+	free(meta.tree);
+}
+
+// Contiguous runs are found where they straddle the words of the bitmap,
+// aligned runs start on the alignment even if the region does not
+static void test_bitmap_runs() {
+	struct ARC_BitmapMeta meta = { 0 };
+	// The region is never dereferenced by the bitmap
+	uint64_t base = 0x100003000;
+	uint64_t ceil = base + 256 * PAGE_SIZE;
+	uint64_t *bitmap = malloc(bitmap_bookkeeping_size(base, ceil, PAGE_SIZE));
+	void *region = (void *)base;
+
+	EXPECT(init_static_bitmap(&meta, bitmap, base, ceil, PAGE_SIZE) == 0);
+	EXPECT(meta.objects == 256 && meta.free_objects == 0);
+	EXPECT(bitmap_contig_free(&meta, region, 256) == region);
+
+	// Pin objects 60 and 130, leaving a free run of 69 across words 0 to 2
+	EXPECT(bitmap_contig_alloc(&meta, 256) == region);
+	EXPECT(bitmap_contig_free(&meta, region, 60) == region);
+	EXPECT(bitmap_contig_free(&meta, region + 61 * PAGE_SIZE, 69) == region + 61 * PAGE_SIZE);
+	EXPECT(bitmap_contig_free(&meta, region + 131 * PAGE_SIZE, 125) == region + 131 * PAGE_SIZE);
+
+	EXPECT(bitmap_contig_alloc(&meta, 69) == region + 61 * PAGE_SIZE);
+	EXPECT(bitmap_contig_alloc(&meta, 61) == region + 131 * PAGE_SIZE);
+	EXPECT(bitmap_is_allocated(&meta, region + 60 * PAGE_SIZE));
+	EXPECT(!bitmap_is_allocated(&meta, region + 59 * PAGE_SIZE));
+	EXPECT(!bitmap_is_allocated(&meta, region + 60 * PAGE_SIZE + 8));
+
+	// Freeing part of a free section again is refused
+	EXPECT(bitmap_contig_free(&meta, region + 50 * PAGE_SIZE, 12) == NULL);
+
+	EXPECT(bitmap_contig_free(&meta, region + 60 * PAGE_SIZE, 1) != NULL);
+	EXPECT(bitmap_contig_free(&meta, region + 61 * PAGE_SIZE, 69) != NULL);
+	EXPECT(bitmap_contig_free(&meta, region + 130 * PAGE_SIZE, 1) != NULL);
+	EXPECT(bitmap_contig_free(&meta, region + 131 * PAGE_SIZE, 61) != NULL);
+	EXPECT(meta.free_objects == 256);
+
+	// The region starts 3 pages past a 16 page boundary, so the first aligned
+	// object is object 13, and a run of 100 spans two word boundaries
+	size_t align = 16 * PAGE_SIZE;
+	void *aligned = bitmap_contig_alloc_aligned(&meta, 100, align);
+	EXPECT(aligned == region + 13 * PAGE_SIZE && ((uintptr_t)aligned & (align - 1)) == 0);
+
+	aligned = bitmap_contig_alloc_aligned(&meta, 100, align);
+	EXPECT(aligned == region + 125 * PAGE_SIZE);
+	EXPECT(bitmap_contig_alloc_aligned(&meta, 100, align) == NULL);
+
+	// Batches free what is allocated and skip the rest
+	void *objects[4] = { region, region + 13 * PAGE_SIZE, region + 14 * PAGE_SIZE, region + 255 * PAGE_SIZE };
+	EXPECT(bitmap_free_n(&meta, 4, objects) == 2);
+	EXPECT(bitmap_alloc_n(&meta, 4, objects) == 4);
+	EXPECT(objects[0] == region && objects[3] == region + 3 * PAGE_SIZE);
+
+	free(bitmap);
+}
+
+// Ranges are kept sorted whatever the order they are inserted in, lookups
+// honour both inclusive ends, and overlapping or excess ranges are refused
+static void test_range_index() {
+	struct ARC_RangeIndex index = { 0 };
+	struct ARC_RangeEntry entries[4] = { 0 };
+	int a = 0, b = 0, c = 0, d = 0;
+
+	EXPECT(init_range_index(&index, entries, 4) == 0);
+	EXPECT(range_index_find(&index, (void *)0x1000) == NULL);
+
+	EXPECT(range_index_insert(&index, (void *)0x5000, (void *)0x5fff, &b) == 0);
+	EXPECT(range_index_insert(&index, (void *)0x1000, (void *)0x1fff, &a) == 0);
+	EXPECT(range_index_insert(&index, (void *)0x3000, (void *)0x3fff, &c) == 0);
+	EXPECT(index.entries[0].owner == &a && index.entries[1].owner == &c && index.entries[2].owner == &b);
+
+	EXPECT(range_index_find(&index, (void *)0x1000) == &a);
+	EXPECT(range_index_find(&index, (void *)0x1fff) == &a);
+	EXPECT(range_index_find(&index, (void *)0x3800) == &c);
+	EXPECT(range_index_find(&index, (void *)0x5fff) == &b);
+	EXPECT(range_index_find(&index, (void *)0x0fff) == NULL);
+	EXPECT(range_index_find(&index, (void *)0x2000) == NULL);
+	EXPECT(range_index_find(&index, (void *)0x6000) == NULL);
+
+	// Overlapping either neighbour, or containing one
+	EXPECT(range_index_insert(&index, (void *)0x1fff, (void *)0x2fff, &d) == -2);
+	EXPECT(range_index_insert(&index, (void *)0x2000, (void *)0x3000, &d) == -2);
+	EXPECT(range_index_insert(&index, (void *)0x0000, (void *)0x7000, &d) == -2);
+	EXPECT(range_index_insert(&index, (void *)0x3000, (void *)0x2000, &d) == -2);
+
+	EXPECT(range_index_insert(&index, (void *)0x2000, (void *)0x2fff, &d) == 0);
+	EXPECT(range_index_find(&index, (void *)0x2000) == &d);
+	EXPECT(range_index_insert(&index, (void *)0x7000, (void *)0x7fff, &d) == -1);
+
+	EXPECT(range_index_remove(&index, &b) == 1);
+	EXPECT(range_index_find(&index, (void *)0x5000) == NULL);
+	EXPECT(range_index_insert(&index, (void *)0x7000, (void *)0x7fff, &d) == 0);
+	EXPECT(range_index_remove(&index, &d) == 2);
+	EXPECT(index.count == 2 && range_index_find(&index, (void *)0x3000) == &c);
+}
+
+// Objects are handed out and taken back across a chain of two lists, one
+// with its meta out of line and one with it at the base of its region
+static void test_freelist_chain() {
+	static struct ARC_FreelistMeta meta;
+	struct ARC_RangeIndex index = { 0 };
+	struct ARC_RangeEntry entries[4] = { 0 };
+	size_t size = 4 * PAGE_SIZE;
+	void *first = aligned_alloc(PAGE_SIZE, size);
+	void *second = aligned_alloc(PAGE_SIZE, size);
+
+	EXPECT(init_static_freelist(&meta, (uint64_t)first, (uint64_t)first + size, 64) == 0);
+	struct ARC_FreelistMeta *joined = init_freelist((uint64_t)second, (uint64_t)second + size, 64);
+	EXPECT(joined == second);
+
+	uint64_t objects = meta.free_objects;
+	uint64_t joined_objects = joined->free_objects;
+	EXPECT(objects == size / 64 && joined_objects < objects);
+
+	EXPECT(link_freelists(&meta, joined) == 0);
+	EXPECT(init_range_index(&index, entries, 4) == 0);
+	EXPECT(freelist_attach_index(&meta, &index) == 0);
+
+	void **taken = malloc((objects + joined_objects) * sizeof(void *));
+	EXPECT(freelist_alloc_n(&meta, objects, taken) == objects);
+	EXPECT(meta.free_objects == 0);
+
+	for (uint64_t i = 0; i < objects; i++) {
+		EXPECT(taken[i] >= first && taken[i] < first + size);
+	}
+
+	// The first list is exhausted, the run comes from the second
+	void *run = freelist_contig_alloc(&meta, 16);
+	EXPECT(run >= second && run + 16 * 64 <= second + size);
+	void *single = freelist_alloc(&meta);
+	EXPECT(single >= second && single < second + size && (single < run || single >= run + 16 * 64));
+	EXPECT(joined->free_objects == joined_objects - 17);
+
+	int foreign = 0;
+	EXPECT(freelist_free(&meta, &foreign) == NULL);
+
+	EXPECT(freelist_contig_free(&meta, run, 16) == run);
+	EXPECT(freelist_free(&meta, single) == single);
+	EXPECT(freelist_free_n(&meta, objects, taken) == objects);
+	EXPECT(meta.free_objects == objects && joined->free_objects == joined_objects);
+
+	// Lock-free lists only run through their untouched objects, a request
+	// none of them can meet hands back what it reserved
+	EXPECT(init_static_freelist(&meta, (uint64_t)first, (uint64_t)first + size, 64) == 0);
+	joined = init_freelist((uint64_t)second, (uint64_t)second + size, 64);
+	EXPECT(link_freelists(&meta, joined) == 0);
+	EXPECT(freelist_set_attributes(&meta, 1) == 0);
+
+	run = freelist_contig_alloc(&meta, objects - 8);
+	EXPECT(run == first);
+	run = freelist_contig_alloc(&meta, 16);
+	EXPECT(run >= second && run < second + size);
+	EXPECT(freelist_contig_alloc(&meta, joined_objects) == NULL);
+	EXPECT(meta.free_objects == 8 && joined->free_objects == joined_objects - 16);
+
+	EXPECT(freelist_alloc_n(&meta, objects + joined_objects, taken) == 8 + joined_objects - 16);
+	EXPECT(freelist_alloc(&meta) == NULL);
+	EXPECT(meta.free_objects == 0 && joined->free_objects == 0);
+
+	free(taken);
+	free(first);
+	free(second);
+}
+
+static struct ARC_FreelistMeta walk_head;
+static struct ARC_FreelistMeta *walk_released = NULL;
+static void *walk_object = NULL;
+
+// Empty the list just walked past, then unlink and release it
+static void release_walked_list() {
+	EXPECT(freelist_free(walk_released, walk_object) == walk_object);
+	EXPECT(unlink_freelist(&walk_head, walk_released) == 0);
+	pmm_contig_free(walk_released->base, 1);
+}
+
+// A list which is unlinked and released right as an allocation walks past it
+// must not be read again by the walk
+static void test_freelist_walk_release() {
+	void *buffer = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	struct ARC_FreelistMeta *lists[2] = { 0 };
+
+	EXPECT(init_static_freelist(&walk_head, (uint64_t)buffer, (uint64_t)buffer + PAGE_SIZE, 2048) == 0);
+
+	for (int i = 0; i < 2; i++) {
+		// One object per page, with the meta at the end as slab_expand does
+		void *page = pmm_contig_alloc(1);
+		lists[i] = page + PAGE_SIZE - sizeof(struct ARC_FreelistMeta);
+
+		EXPECT(init_static_freelist(lists[i], (uint64_t)page, (uint64_t)lists[i], 2048) == 0);
+		EXPECT(lists[i]->free_objects == 1);
+		EXPECT(link_freelists(&walk_head, lists[i]) == 0);
+	}
+
+	EXPECT(freelist_alloc(&walk_head) == buffer);
+	EXPECT(freelist_alloc(&walk_head) == buffer + 2048);
+
+	walk_released = lists[0];
+	walk_object = freelist_alloc(&walk_head);
+	EXPECT(walk_object == lists[0]->base);
+
+	// The walk steps from the head, past the first list, onto the second
+	unlock_hook = release_walked_list;
+	unlock_watch = &lists[0]->mutex;
+
+	EXPECT(freelist_alloc(&walk_head) == lists[1]->base);
+	EXPECT(unlock_watch == NULL && walk_head.next == lists[1]);
+
+	free(buffer);
+}
+
+#define STRESS_THREADS 8
+#define STRESS_OBJECTS 256
+
+static struct ARC_SlabMeta stress_slab;
+// Number of workers done
+static int stress_done = 0;
+
+// Allocate and free batches of objects of one class, checking that no object
+// is handed out twice
+static void *stress_worker(void *arg) {
+	test_cpu = (uintptr_t)arg;
+
+	uint64_t *objects[STRESS_OBJECTS] = { 0 };
+	uint64_t seed = 0x9E3779B97F4A7C15 * (test_cpu + 1);
+
+	for (int round = 0; round < 2000; round++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+
+		int count = (seed % STRESS_OBJECTS) + 1;
+
+		for (int i = 0; i < count; i++) {
+			objects[i] = slab_alloc(&stress_slab, 64);
+			EXPECT(objects[i] != NULL);
+
+			if (objects[i] != NULL) {
+				objects[i][1] = seed + i;
+			}
+		}
+
+		for (int i = 0; i < count; i++) {
+			if (objects[i] != NULL) {
+				EXPECT(objects[i][1] == seed + i);
+				EXPECT(slab_free(&stress_slab, objects[i]) == objects[i]);
+			}
+		}
+	}
+
+	__atomic_add_fetch(&stress_done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+// Regions released by slab_shrink must never be walked into by allocations
+// and frees running at the same time on the lists they were unlinked from
+static void test_slab_concurrent_shrink() {
+	size_t sizes[] = { 64 };
+	size_t pages = 1;
+	void *range = pmm_contig_alloc(pages);
+
+	EXPECT(init_slab(&stress_slab, range, pages * PAGE_SIZE, sizes, 1, 0) == range + pages * PAGE_SIZE);
+	EXPECT(slab_set_growth(&stress_slab, ARC_SLAB_GROW_FIXED, 1, 0) == 0);
+
+	pthread_t threads[STRESS_THREADS];
+
+	for (uintptr_t i = 0; i < STRESS_THREADS; i++) {
+		pthread_create(&threads[i], NULL, stress_worker, (void *)i);
+	}
+
+	size_t released = 0;
+
+	while (__atomic_load_n(&stress_done, __ATOMIC_ACQUIRE) < STRESS_THREADS) {
+		released += slab_shrink(&stress_slab);
+	}
+
+	for (int i = 0; i < STRESS_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	EXPECT(released > 0);
+
+	// Everything was freed, so every grown region goes
+	slab_shrink(&stress_slab);
+	EXPECT(stress_slab.lists[0]->next == NULL);
+	EXPECT(stress_slab.growth.grown[0] == 0);
+}
+
+// An object freed with the size of another class goes back to its own class,
+// and foreign addresses are refused
+static struct ARC_SlabMeta sized_slab;
+
+static void test_slab_free_sized_class() {
+	size_t sizes[] = { 64, 128 };
+	size_t pages = 2;
+	void *range = pmm_contig_alloc(pages);
+
+	EXPECT(init_slab(&sized_slab, range, pages * PAGE_SIZE, sizes, 2, 1 << 2) == range + pages * PAGE_SIZE);
+
+	void *small = slab_alloc(&sized_slab, 64);
+	void *large = slab_alloc(&sized_slab, 128);
+	EXPECT(small != NULL && large != NULL);
+
+	EXPECT(slab_free_sized(&sized_slab, small, 128) == small);
+	EXPECT(slab_free_sized(&sized_slab, large, 100) == large);
+
+	EXPECT(slab_alloc(&sized_slab, 128) == large);
+	EXPECT(slab_alloc(&sized_slab, 64) == small);
+
+	uint64_t foreign = 0;
+	EXPECT(slab_free_sized(&sized_slab, &foreign, 64) == NULL);
+}
+
+struct cached_object {
+	uint64_t magic;
+	uint64_t state;
+	uint64_t pad;
+};
+
+static int constructed = 0;
+static int destructed = 0;
+
+static void cached_ctor(void *object) {
+	struct cached_object *cached = object;
+
+	EXPECT(cached->magic == 0);
+	cached->magic = 0xC0FFEE;
+	cached->state = 0;
+	constructed++;
+}
+
+static void cached_dtor(void *object) {
+	EXPECT(((struct cached_object *)object)->magic == 0xC0FFEE);
+	destructed++;
+}
+
+// Objects of a cache are constructed once per region and keep their state
+// across frees, they are only destructed when their region is released
+static void test_slab_cache_construct() {
+	struct ARC_SlabCache cache;
+	constructed = 0;
+	destructed = 0;
+
+	EXPECT(init_slab_cache(&cache, "cached", sizeof(struct cached_object), 0, cached_ctor, cached_dtor, ARC_SLAB_ZERO, 1, 0) == 0);
+
+	int first = PAGE_SIZE / cache.stride;
+	EXPECT(constructed == first);
+
+	struct cached_object *object = slab_cache_alloc(&cache);
+	EXPECT(object != NULL && object->magic == 0xC0FFEE);
+	object->state = 42;
+	EXPECT(slab_cache_free(&cache, object) == object);
+
+	// Neither the free nor the allocation touch the object
+	struct cached_object *again = slab_cache_alloc(&cache);
+	EXPECT(again == object && again->state == 42);
+	EXPECT(constructed == first && destructed == 0);
+
+	// Only pointers to the start of an object are taken back
+	EXPECT(slab_cache_free(&cache, (void *)again + 8) == NULL);
+	EXPECT(slab_cache_free(&cache, again) == again);
+
+	// Run the first region dry so that the cache grows a second one
+	struct cached_object *objects[PAGE_SIZE / sizeof(struct cached_object) + 1];
+
+	for (int i = 0; i <= first; i++) {
+		objects[i] = slab_cache_alloc(&cache);
+		EXPECT(objects[i] != NULL && objects[i]->magic == 0xC0FFEE);
+	}
+
+	int grown = constructed - first;
+	EXPECT(grown > 0 && cache.grown == 1);
+
+	for (int i = 0; i <= first; i++) {
+		EXPECT(slab_cache_free(&cache, objects[i]) == objects[i]);
+	}
+
+	EXPECT(slab_cache_shrink(&cache) == 1);
+	EXPECT(destructed == grown);
+
+	// The cache cannot go while an object is out, then takes the rest along
+	object = slab_cache_alloc(&cache);
+	EXPECT(slab_cache_destroy(&cache) == -1);
+	EXPECT(destructed == grown);
+	EXPECT(slab_cache_free(&cache, object) == object);
+	EXPECT(slab_cache_destroy(&cache) == 0);
+	EXPECT(destructed == constructed);
+}
+
+// Destroying a cache with magazines destructs the objects they still hold
+static void test_slab_cache_destroy_magazines() {
+	struct ARC_SlabCache cache;
+	constructed = 0;
+	destructed = 0;
+
+	EXPECT(init_slab_cache(&cache, "magazines", sizeof(struct cached_object), 0, cached_ctor, cached_dtor, 0, 2, 1 << 2) == 0);
+	EXPECT(cache.cpus != NULL);
+
+	void *objects[STRESS_OBJECTS];
+
+	for (int i = 0; i < STRESS_OBJECTS; i++) {
+		objects[i] = slab_cache_alloc(&cache);
+		EXPECT(objects[i] != NULL);
+	}
+
+	for (int i = 0; i < STRESS_OBJECTS; i++) {
+		EXPECT(slab_cache_free(&cache, objects[i]) == objects[i]);
+	}
+
+	EXPECT(cache.stats.active == 0);
+	EXPECT(slab_cache_destroy(&cache) == 0);
+	EXPECT(constructed > 0 && destructed == constructed);
+}
+
+// Only the pages of an allocation which hold its size are mapped, the rest of
+// its block is mapped as it grows into it
+static void test_vmm_mapped() {
+	size_t size = 16 * 1024 * 1024;
+	void *range = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	EXPECT(range != MAP_FAILED && init_vmm(range, size) == 0);
+
+	uint8_t *a = vmm_alloc(5 * PAGE_SIZE);
+	EXPECT(a != NULL);
+	EXPECT(vmm_size(a) == 5 * PAGE_SIZE && pager_mapped == 5 * PAGE_SIZE);
+
+	memset(a, 0xA5, 5 * PAGE_SIZE);
+
+	// Still within the block of 8 pages
+	EXPECT(vmm_grow(a, 7 * PAGE_SIZE - 1) == a);
+	EXPECT(vmm_size(a) == 7 * PAGE_SIZE && pager_mapped == 7 * PAGE_SIZE);
+	EXPECT(a[5 * PAGE_SIZE - 1] == 0xA5 && a[7 * PAGE_SIZE - 1] == 0);
+
+	uint8_t *b = vmm_remap(a, 20 * PAGE_SIZE);
+	EXPECT(b != NULL);
+	EXPECT(vmm_size(b) == 20 * PAGE_SIZE && pager_mapped == 20 * PAGE_SIZE);
+	EXPECT(b[0] == 0xA5 && b[5 * PAGE_SIZE - 1] == 0xA5);
+
+	EXPECT(vmm_shrink(b, 3 * PAGE_SIZE) == b);
+	EXPECT(vmm_size(b) == 3 * PAGE_SIZE && pager_mapped == 3 * PAGE_SIZE);
+
+	// The freed block stays mapped in the cache and is mapped up to the
+	// next allocation of its size
+	EXPECT(vmm_free(b) == b);
+	EXPECT(pager_mapped == 3 * PAGE_SIZE);
+
+	uint8_t *c = vmm_alloc(4 * PAGE_SIZE);
+	EXPECT(c == b);
+	EXPECT(vmm_size(c) == 4 * PAGE_SIZE && pager_mapped == 4 * PAGE_SIZE);
+
+	EXPECT(vmm_free(c) == c);
+	EXPECT(vmm_cache_flush() == 4 * PAGE_SIZE);
+	EXPECT(pager_mapped == 0);
+}
+
+// Blocks are told apart by state kept outside of them, so what a block holds
+// never makes vmm_free refuse it, and freeing twice or with the wrong
+// function is refused
+static void test_vmm_free_refusal() {
+	uint64_t *a = vmm_alloc(PAGE_SIZE);
+	EXPECT(a != NULL);
+
+	// Fill the block with what a cached one would hold
+	for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+		a[i] = (uintptr_t)a;
+	}
+
+	EXPECT(vmm_free(a) == a);
+	EXPECT(vmm_free(a) == NULL);
+	EXPECT(vmm_size(a) == 0);
+
+	uint64_t *b = vmm_alloc(PAGE_SIZE);
+	EXPECT(b == a && vmm_size(b) == PAGE_SIZE);
+	EXPECT(vmm_free_nopage(b) == 0);
+	EXPECT(vmm_free(b) == b);
+
+	void *c = vmm_alloc_nopage(4 * PAGE_SIZE);
+	EXPECT(c != NULL && vmm_size(c) == 0);
+	EXPECT(vmm_free(c) == NULL);
+	EXPECT(vmm_grow(c, 8 * PAGE_SIZE) == NULL);
+	EXPECT(vmm_free_nopage(c) == 4 * PAGE_SIZE);
+	EXPECT(vmm_free_nopage(c) == 0);
+
+	vmm_cache_flush();
+	EXPECT(pager_mapped == 0);
+}
+
+int main() {
+	test_buddy_fragmentation();
+	test_buddy_resize();
+	test_buddy_aligned();
+	test_bitmap_runs();
+	test_range_index();
+	test_freelist_chain();
+	test_freelist_walk_release();
+	test_slab_concurrent_shrink();
+	test_slab_free_sized_class();
+	test_slab_cache_construct();
+	test_slab_cache_destroy_magazines();
+	test_vmm_mapped();
+	test_vmm_free_refusal();
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed;
+}